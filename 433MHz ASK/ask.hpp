@@ -4,15 +4,59 @@
 #include <stdint.h>
 #include <chrono>
 #include <thread>
+#include <atomic>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+#include "ask_fec.hpp"
+
+#ifndef DIV_PER_BIT
 #define DIV_PER_BIT 8
+#endif
+
+// The reader traces each stage of a frame it reads on stderr. Set this to 0
+// to leave that out, e.g. when benchmarking.
+#ifndef ASK_TRACE
+#define ASK_TRACE 1
+#endif
 
 typedef uint32_t preamble_t;
 #define FRAME_PREAMBLE 0xd31f26e7
 
+// Frames come in two formats, which a reader can take side by side.
+//
+// A v1 frame is FRAME_PREAMBLE, then the payload length as a 4 byte
+// ask_len_t, the payload, and the FCS.
+//
+// A v2 frame cuts the overhead for short payloads. It is FRAME_SYNC_V2, half
+// the length of the preamble, then a header of:
+// - The payload length, shifted up a bit with the low bit set if a flags
+//   byte follows, as a varint: the low 7 bits, with the top bit set if a
+//   second byte follows with the next 7. So up to 63 bytes of payload costs
+//   one byte of header, and up to ASK_V2_MAX_PAYLOAD two.
+// - The flags byte, if there is one.
+// Then the payload and FCS as in v1. Each header byte is a field of its own,
+// and the FCS covers the sync word, header and payload in the order sent.
+//
+// The sync word is at least 6 bits from every 16 bits of FRAME_PREAMBLE (and
+// the idle line before it), so a v1 frame can't be mistaken for a v2 one.
+#define FRAME_SYNC_V2 0x752c
+#define ASK_V2_MAX_PAYLOAD 8191
+#define ASK_V2_MAX_HEADER 3
+
+enum ASK_FRAME_FORMAT {
+    ASK_FRAME_V1 = 0x0,
+    ASK_FRAME_V2 = 0x1
+};
+
+// Bits of a v2 frame's flags byte.
+//
+// The payload is several datagrams, led by a table of their lengths: a count
+// byte, then each length as a varint like the v2 length. The reader hands
+// each datagram to datagram_ready() on its own. See ask_aggregate.hpp.
+#define ASK_FLAG_AGGREGATE 0x01
+
 // [sum([int(b) for b in list(("%8s"%bin(i)[2:]).replace(' ', '0'))]) for i in range(256)]
 static const uint8_t ONES_PER_BYTE[] = {
     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 1, 2, 2, 3, 2, 3, 
@@ -31,17 +75,165 @@ static const uint8_t ONES_PER_BYTE[] = {
 
 
 typedef int32_t ask_len_t;
+
+// The longest payload (FEC parity included) a reader without a pool takes.
+// A longer length must be corrupt, so the frame is dropped as soon as the
+// length is read, rather than allocated. A reader with a pool takes up to
+// the pool's mtu instead.
+#ifndef ASK_MAX_PAYLOAD
+#define ASK_MAX_PAYLOAD 1024
+#endif
+static_assert(ASK_MAX_PAYLOAD > 0 && ASK_MAX_PAYLOAD <= INT32_MAX / 2,
+    "ASK_MAX_PAYLOAD must leave room to count the symbols of a payload");
+
+// The frame check sequence, chosen at build time. It covers the preamble,
+// length and payload in the order they are sent, which is last byte first
+// within each field, so the reader can keep it up to date a byte at a time.
+#define ASK_FCS_XOR8 0
+// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xffff.
+#define ASK_FCS_CRC16 1
+// CRC-32 (IEEE 802.3): reflected polynomial 0xedb88320.
+#define ASK_FCS_CRC32 2
+
+#ifndef ASK_FCS
+#define ASK_FCS ASK_FCS_CRC16
+#endif
+
+#if ASK_FCS == ASK_FCS_XOR8
 typedef uint8_t checksum_t;
+#define ASK_FCS_INIT 0
+#elif ASK_FCS == ASK_FCS_CRC16
+typedef uint16_t checksum_t;
+#define ASK_FCS_INIT 0xffff
+#elif ASK_FCS == ASK_FCS_CRC32
+typedef uint32_t checksum_t;
+#define ASK_FCS_INIT 0xffffffff
+#else
+#error "ASK_FCS must be one of ASK_FCS_XOR8, ASK_FCS_CRC16 or ASK_FCS_CRC32"
+#endif
+
+// Slice-by-4 tables: slice k holds the CRC of a byte followed by k zero bytes.
+struct ask_fcs_tables {
+    checksum_t slice[4][256];
+};
+
+constexpr struct ask_fcs_tables __ask_fcs_make_tables()
+{
+    struct ask_fcs_tables tables = {};
+
+    for (int i = 0 ; i < 256 ; i++)
+    {
+#if ASK_FCS == ASK_FCS_CRC16
+        uint16_t crc = i << 8;
+        for (int b = 0 ; b < 8 ; b++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+#else
+        uint32_t crc = i;
+        for (int b = 0 ; b < 8 ; b++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : (crc >> 1);
+        }
+#endif
+        tables.slice[0][i] = crc;
+    }
+
+    for (int k = 1 ; k < 4 ; k++)
+    {
+        for (int i = 0 ; i < 256 ; i++)
+        {
+            checksum_t prev = tables.slice[k - 1][i];
+#if ASK_FCS == ASK_FCS_CRC16
+            tables.slice[k][i] = (prev << 8) ^ tables.slice[0][prev >> 8];
+#else
+            tables.slice[k][i] = (prev >> 8) ^ tables.slice[0][prev & 0xff];
+#endif
+        }
+    }
+
+    return tables;
+}
+
+#if ASK_FCS != ASK_FCS_XOR8
+static constexpr struct ask_fcs_tables ASK_FCS_TABLES = __ask_fcs_make_tables();
+#endif
+
+inline checksum_t __ask_fcs_update_byte(checksum_t fcs, uint8_t byte)
+{
+#if ASK_FCS == ASK_FCS_XOR8
+    return fcs ^ byte;
+#elif ASK_FCS == ASK_FCS_CRC16
+    return (fcs << 8) ^ ASK_FCS_TABLES.slice[0][(fcs >> 8) ^ byte];
+#else
+    return (fcs >> 8) ^ ASK_FCS_TABLES.slice[0][(fcs ^ byte) & 0xff];
+#endif
+}
+
+// Fold a field into the FCS in the order it is sent, last byte first.
+checksum_t __ask_fcs_update(checksum_t fcs, uint8_t* data, ask_len_t len)
+{
+    ask_len_t i = len;
+
+#if ASK_FCS != ASK_FCS_XOR8
+    // Four bytes per step while there are enough of them.
+    for ( ; i >= 4 ; i -= 4)
+    {
+#if ASK_FCS == ASK_FCS_CRC16
+        fcs = ASK_FCS_TABLES.slice[3][(fcs >> 8) ^ data[i - 1]] ^
+            ASK_FCS_TABLES.slice[2][(fcs & 0xff) ^ data[i - 2]] ^
+            ASK_FCS_TABLES.slice[1][data[i - 3]] ^
+            ASK_FCS_TABLES.slice[0][data[i - 4]];
+#else
+        fcs ^= data[i - 1] | (data[i - 2] << 8) | (data[i - 3] << 16) | ((uint32_t)data[i - 4] << 24);
+        fcs = ASK_FCS_TABLES.slice[3][fcs & 0xff] ^
+            ASK_FCS_TABLES.slice[2][(fcs >> 8) & 0xff] ^
+            ASK_FCS_TABLES.slice[1][(fcs >> 16) & 0xff] ^
+            ASK_FCS_TABLES.slice[0][fcs >> 24];
+#endif
+    }
+#endif
 
+    for ( ; i > 0 ; i--)
+    {
+        fcs = __ask_fcs_update_byte(fcs, data[i - 1]);
+    }
+
+    return fcs;
+}
+
+inline checksum_t __ask_fcs_finish(checksum_t fcs)
+{
+#if ASK_FCS == ASK_FCS_CRC32
+    return ~fcs;
+#else
+    return fcs;
+#endif
+}
+
+// The line code for everything after the preamble, chosen per link. Each
+// nybble is sent as a symbol of a few bits, and each bit as DIV_PER_BIT
+// divisions. The preamble is always sent as its raw bits, so it is found the
+// same way whatever the encoding.
+//
+// - BALANCED_REPEATED: 4b6b, with three 1s in every 6-bit symbol, so the
+//   line stays DC balanced, a run is at most four bits long, and most
+//   corrupt symbols are caught.
+// - UNBALANCED_REPEATED: the nybble's own 4 bits. The least airtime, but a
+//   long run gives the PLL nothing to follow, and no symbol is invalid.
+// - MANCHESTER: each bit as two, 01 for a 1 and 10 for a 0. The most
+//   airtime, but there is a transition in every bit, so the PLL never goes
+//   without, and any 00 or 11 pair is caught.
 enum ENCODING {
-    UNBALANCED_REPEATED = 0x0,
-    BALANCED_REPEATED = 0x1,
+    BALANCED_REPEATED = 0x0,
+    UNBALANCED_REPEATED = 0x1,
     MANCHESTER = 0x2
 };
 
 enum PACKET_READ_STAGE {
     PREAMBLE_SCAN,
     PREAMBLE_SCAN_COMPLETE,
+    HEADER_READ,
     PAYLOAD_LENGTH_READ,
     PAYLOAD_LENGTH_READ_COMPLETE,
     PAYLOAD_READ,
@@ -57,7 +249,7 @@ enum PACKET_READ_STAGE {
     PACKET_DISCARD
 };
 
-static const uint8_t SYMBOLS46[] =
+static constexpr uint8_t SYMBOLS46[] =
 {
     0xd,  0xe,  0x13, 0x15, 0x16, 0x19, 0x1a, 0x1c, 
     0x23, 0x25, 0x26, 0x29, 0x2a, 0x2c, 0x32, 0x34
@@ -90,9 +282,69 @@ static const uint8_t SYMBOLS64[] =
     240, 240, 240, 240, 240, 240, 240, 240
 };
 
+static constexpr uint8_t SYMBOLS44[] =
+{
+    0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7,
+    0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf
+};
+
+struct ask_manchester_tables {
+    uint8_t encode[16];
+    uint8_t decode[256];
+};
+
+constexpr struct ask_manchester_tables __ask_manchester_make_tables()
+{
+    struct ask_manchester_tables tables = {};
+
+    for (int i = 0 ; i < 256 ; i++)
+    {
+        tables.decode[i] = 240;
+    }
+    for (int nybble = 0 ; nybble < 16 ; nybble++)
+    {
+        uint8_t symbol = 0;
+        for (int b = 3 ; b >= 0 ; b--)
+        {
+            symbol = (symbol << 2) | (((nybble >> b) & 1) ? 0x1 : 0x2);
+        }
+        tables.encode[nybble] = symbol;
+        tables.decode[symbol] = nybble;
+    }
+
+    return tables;
+}
+
+static constexpr struct ask_manchester_tables SYMBOLS_MANCHESTER = __ask_manchester_make_tables();
+
+// Each encoding's symbol length, and its tables from nybble to symbol, and
+// back from symbol to nybble (or 240 if it is invalid).
+struct ask_line_code {
+    uint8_t symbol_bits;
+    const uint8_t* encode;
+    const uint8_t* decode;
+};
+
+static constexpr struct ask_line_code ASK_LINE_CODES[] = {
+    {6, SYMBOLS46, SYMBOLS64},
+    {4, SYMBOLS44, SYMBOLS44},
+    {8, SYMBOLS_MANCHESTER.encode, SYMBOLS_MANCHESTER.decode},
+};
+
 struct ask_writer_params {
     void(*write)(uint8_t);
     uint32_t us_per_div;
+    // When set, ask_write() generates each division on the fly in the
+    // writer callback instead of pre-expanding the frame into a pulse stream.
+    bool streaming;
+    // Idle divisions sent between back-to-back frames.
+    uint32_t inter_frame_divs;
+    // FEC applied to every payload. Must match the reader's.
+    struct ask_fec_params fec;
+    // The line code. Must match the reader's.
+    enum ENCODING encoding;
+    // Frames longer than ASK_V2_MAX_PAYLOAD are always sent as v1.
+    enum ASK_FRAME_FORMAT format;
 };
 
 struct ask_frame {
@@ -100,34 +352,456 @@ struct ask_frame {
     ask_len_t payload_byte_count;
     uint8_t* data;
     checksum_t checksum;
+    // Set by the reader as the last FCS symbol is read.
+    bool fcs_ok;
+    // With FEC, a bitmap of the payload bytes that had an invalid symbol.
+    uint8_t* erasures;
+    enum ASK_FRAME_FORMAT format;
+    // A v2 frame's flags, and its header in the order it is sent.
+    uint8_t flags;
+    uint8_t header[ASK_V2_MAX_HEADER];
+    uint8_t header_len;
+};
+
+// The encoded pulse stream is stored one division per bit, packed LSB-first
+// into 32-bit words, so division k lives at bit (k % 32) of word (k / 32).
+typedef uint32_t ask_pulse_word_t;
+#define ASK_PULSES_PER_WORD (8 * sizeof(ask_pulse_word_t))
+#define ASK_PULSE_WORDS(n) (((n) + ASK_PULSES_PER_WORD - 1) / ASK_PULSES_PER_WORD)
+
+// A single piece of a scatter-gather payload. Pieces are concatenated in
+// order to form the datagram, and must stay valid until the frame is sent.
+struct ask_iovec {
+    uint8_t* data;
+    ask_len_t len;
+};
+
+#define ASK_MAX_IOV 8
+
+struct ask_stream_segment {
+    uint8_t* data;
+    ask_len_t len;
+    // Sent with the writer's line code, rather than as raw bits.
+    bool line_coded;
+};
+
+// Position of the streaming encoder within a frame, in on-air order.
+//
+// Each segment is sent last byte first, high nybble first, MSB first, to
+// match ask_encode_bytes(). The frame is laid out as preamble, length,
+// payload pieces (last piece first) and then the checksum.
+struct ask_stream_cursor {
+    const struct ask_line_code* code;
+    struct ask_stream_segment segments[ASK_MAX_IOV + ASK_V2_MAX_HEADER + 2];
+    uint8_t num_segments;
+    uint8_t segment;
+    ask_len_t byte;
+    uint8_t nybble;
+    uint8_t symbol;
+    int8_t symbol_bit;
+    uint8_t div;
+};
+
+// Number of frames that can be waiting to be sent. Must be a power of two.
+#define ASK_TX_QUEUE_DEPTH 8
+
+// A frame waiting in the transmit queue.
+struct ask_tx_frame {
+    // The frame header, which the streaming encoder reads from in place.
+    struct ask_frame frame;
+    struct ask_iovec iov[ASK_MAX_IOV];
+    uint8_t iovcnt;
+    // The pre-encoded pulse stream, or NULL if the frame is to be streamed.
+    ask_pulse_word_t* bit_stream;
+    ask_len_t num_bits;
+    // The FEC encoded payload, owned by the queue until the frame is sent.
+    uint8_t* fec_data;
+};
+
+struct ask_writer_stats {
+    // Updated only by the producer (ask_write).
+    uint32_t frames_queued;
+    uint32_t queue_full;
+    uint32_t max_queue_depth;
+    // Updated only by the writer callback.
+    volatile uint32_t frames_sent;
+    // Times the channel went idle after a frame because nothing was queued.
+    volatile uint32_t underruns;
 };
 
 struct ask_writer {
     struct ask_writer_params params;
+
+    // Single-producer/single-consumer ring of frames to send. queue_head is
+    // only advanced by ask_write(), and queue_tail only by the callback once
+    // it has finished with a frame, so neither side needs a lock.
+    struct ask_tx_frame queue[ASK_TX_QUEUE_DEPTH];
+    volatile uint32_t queue_head;
+    volatile uint32_t queue_tail;
+
+    // The frame in flight, which stays in the queue until it is sent.
+    struct ask_tx_frame* current;
     ask_len_t num_bits;
-    uint8_t* bit_stream;
     ask_len_t bit_cursor;
-    volatile bool channel_ready;
+    // The word currently being shifted out by the writer callback, so that
+    // each division only costs a shift, and memory is touched once per word.
+    ask_pulse_word_t bit_word;
+    struct ask_stream_cursor stream;
+    uint32_t gap_divs;
     volatile bool data_ready;
+    // Set while frames are going out back-to-back, so that the first time the
+    // queue is found empty can be counted as an underrun.
+    bool busy;
+
+    struct ask_writer_stats stats;
 };
 
+// Most free buffers a pool can hold. Must be a power of two.
+#define ASK_POOL_MAX_BUFFERS 16
+
+// A fixed set of receive buffers, each big enough for an mtu byte payload,
+// allocated once up front so that the reader never calls the allocator. The
+// reader loans one for each frame as its length is read, and throws away
+// frames longer than the mtu (or arriving while no buffer is free) there and
+// then, so a corrupt length costs nothing. A buffer handed to datagram_ready()
+// stays on loan to the consumer until it gives it back with ask_pool_return().
+//
+// The reader needs one buffer for the frame it is reading, and one for each
+// frame waiting in its completion queue, on top of those the consumer holds.
+// A frame leaves the queue before datagram_ready() is called with it, so the
+// consumer always holds at least that one, which makes
+// ASK_RX_QUEUE_DEPTH + 2 the least that never runs out.
+//
+// Buffers are loaned out by the reader callback, and returned only by the
+// consumer, so the free buffers are a single-producer/single-consumer ring.
+struct ask_pool {
+    uint8_t* memory;
+    ask_len_t mtu;
+    // Each buffer is the payload, then room for its FEC erasure bitmap.
+    ask_len_t stride;
+    uint8_t num_buffers;
+
+    uint8_t* free_buffers[ASK_POOL_MAX_BUFFERS];
+    // Only advanced by ask_pool_return().
+    volatile uint32_t free_head;
+    // Only advanced by __ask_pool_loan().
+    volatile uint32_t free_tail;
+    // The datagrams of an aggregated frame share its buffer, so each buffer
+    // counts how many of them are still to come back. Only the consumer
+    // touches this, and 0 is the same as 1.
+    uint8_t refs[ASK_POOL_MAX_BUFFERS];
+};
+
+// Allocate num_buffers buffers of mtu bytes. Returns false if there are more
+// than ASK_POOL_MAX_BUFFERS, the mtu is too long to count the symbols of, or
+// there is not enough memory.
+bool ask_pool_init(struct ask_pool* pool, ask_len_t mtu, uint8_t num_buffers)
+{
+    pool->mtu = mtu;
+    pool->stride = mtu + (mtu + 7) / 8 + 1;
+    pool->num_buffers = num_buffers;
+    pool->free_head = 0;
+    pool->free_tail = 0;
+    pool->memory = NULL;
+    if (mtu < 0 || mtu > INT32_MAX / 2 || num_buffers > ASK_POOL_MAX_BUFFERS)
+    {
+        return false;
+    }
+
+    pool->memory = (uint8_t*)malloc((size_t)pool->stride * num_buffers);
+    if (pool->memory == NULL)
+    {
+        return false;
+    }
+    for (uint8_t i = 0 ; i < num_buffers ; i++)
+    {
+        pool->free_buffers[pool->free_head++ % ASK_POOL_MAX_BUFFERS] = pool->memory + (size_t)i * pool->stride;
+        pool->refs[i] = 0;
+    }
+    return true;
+}
+
+// Free the pool's memory, once no reader is using it.
+void ask_pool_free(struct ask_pool* pool)
+{
+    free(pool->memory);
+    pool->memory = NULL;
+}
+
+// Take a free buffer, or NULL if there are none. Only the reader calls this.
+inline uint8_t* __ask_pool_loan(struct ask_pool* pool)
+{
+    if (pool->free_tail == pool->free_head)
+    {
+        return NULL;
+    }
+
+    // Pairs with the release in ask_pool_return().
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint8_t* buffer = pool->free_buffers[pool->free_tail % ASK_POOL_MAX_BUFFERS];
+    pool->free_tail = pool->free_tail + 1;
+    return buffer;
+}
+
+// Give back a buffer handed over by datagram_ready(), from the same single
+// consumer that calls ask_reader_process(). data may point anywhere in the
+// buffer, which is only free once every datagram in it is back.
+inline void ask_pool_return(struct ask_pool* pool, uint8_t* data)
+{
+    if (data == NULL)
+    {
+        return;
+    }
+
+    size_t i = (data - pool->memory) / pool->stride;
+    if (pool->refs[i] > 1)
+    {
+        pool->refs[i]--;
+        return;
+    }
+    pool->refs[i] = 0;
+
+    pool->free_buffers[pool->free_head % ASK_POOL_MAX_BUFFERS] = pool->memory + i * pool->stride;
+    std::atomic_thread_fence(std::memory_order_release);
+    pool->free_head = pool->free_head + 1;
+}
+
 struct ask_reader_params {
+    // Polled once per division by ask_reader_callback(). Not needed when the
+    // reader is driven by ask_reader_edge() instead.
     uint8_t(*read)();
     void(*datagram_ready)(uint8_t* data, ask_len_t datalen);
     uint32_t us_per_div;
+    // The number of preamble bits that may be wrong (the Hamming distance from
+    // FRAME_PREAMBLE) for the preamble to still be accepted.
+    uint8_t preamble_max_errors;
+    // FEC expected on every payload. Must match the writer's.
+    struct ask_fec_params fec;
+    // Where payloads are read into, which should normally be set, so that
+    // receiving never calls the allocator. With one, datagram_ready() must
+    // ask_pool_return() each payload. Without one, each payload of up to
+    // ASK_MAX_PAYLOAD bytes is allocated with calloc(), and datagram_ready()
+    // must free() it.
+    struct ask_pool* pool;
+    // The line code. Must match the writer's.
+    enum ENCODING encoding;
+    // Take v2 frames as well as v1 ones.
+    bool accept_v2;
+    // Measure each sender's division period from its preamble, and take
+    // senders from us_per_div up to this, rather than only at us_per_div.
+    // us_per_div is then the polling period (or the finest edge timing),
+    // which must be well under the fastest sender's. 0 turns this off.
+    uint32_t max_us_per_div;
 };
 
+// Number of pulses out of DIV_PER_BIT that must be high for a symbol bit
+// to read as a 1.
+#define ASK_SYMBOL_ONES_THRESHOLD (DIV_PER_BIT / 2 + 1)
+
+// Symbol bit timing is recovered with a software PLL, so that the reader
+// follows the sender's clock over long frames instead of free-running from
+// the preamble lock.
+//
+// A ramp advances by ASK_PLL_RAMP_INC per pulse, and a bit is complete each
+// time it passes ASK_PLL_RAMP_LEN. A transition should be seen on the first
+// pulse of a bit, and ideally half a pulse after the ramp wrapped (a ramp of
+// ASK_PLL_RAMP_INC / 2), which leaves half a pulse of margin either side.
+// On each transition, the ramp's distance from that is the phase error, and
+// 1/ASK_PLL_GAIN_DIV of it is corrected.
+//
+// Unlike a fixed retard/advance step, a transition exactly on time makes no
+// adjustment, which keeps the bit windows aligned at low oversampling.
+//
+// A single flipped pulse would otherwise look like two transitions in the
+// middle of a bit, and drag the phase a long way. So a transition is only
+// acted on once the new level has been held for a second pulse, and if the
+// old level had been held for at least two pulses before it.
+#define ASK_PLL_RAMP_INC 20
+#define ASK_PLL_RAMP_LEN (ASK_PLL_RAMP_INC * DIV_PER_BIT)
+#define ASK_PLL_RAMP_TRANSITION (ASK_PLL_RAMP_LEN / 2)
+#define ASK_PLL_GAIN_DIV 4
+
 struct ask_symbol_read_state {
     uint8_t* output;
     ask_len_t num_symbols;
-    //TODO Efficiency gains here of 5 bytes, since we can process
-    // each symbol as it completes, instead of needing them all stored
-    uint8_t pulses[6];
-    ask_len_t num_pulses_read;
+    // Each bit is voted on as soon as the PLL says it is complete, and
+    // shifted into the symbol, so no pulses are kept once a bit is decided.
+    uint8_t symbol;
+    uint8_t symbol_bits;
+    uint8_t bit_ones;
+    uint8_t last_pulse;
+    uint8_t run_length;
+    int16_t pll_ramp;
+    // The phase error of a transition waiting for its new level to be held.
+    bool pll_pending;
+    int16_t pll_error;
+    // The line code symbols are read in.
+    const struct ask_line_code* code;
 };
 
+// Number of pulses out of DIV_PER_BIT that must be high for a preamble bit
+// to read as a 1.
+#define ASK_PREAMBLE_ONES_THRESHOLD (DIV_PER_BIT * 3 / 4)
+
+// The preamble is correlated incrementally rather than re-decoded from a
+// buffer of every pulse.
+//
+// The preamble visible at any instant is made of bits whose windows all
+// share the same phase (tick count mod DIV_PER_BIT). So one decoded preamble
+// is kept per phase, and each tick only the current phase's word is shifted
+// along by the majority of the most recent bit period of pulses, which is
+// itself kept as a running count updated by the incoming and outgoing pulse.
 struct ask_preamble_read_state {
-    uint64_t frame_preamble_pulses[sizeof(preamble_t)];
+    // The last DIV_PER_BIT pulses, newest in the LSB.
+    uint32_t pulse_window;
+    uint8_t pulse_window_ones;
+    uint8_t phase;
+    preamble_t phase_preambles[DIV_PER_BIT];
+
+    // Once a candidate preamble is seen, the following DIV_PER_BIT - 1 ticks
+    // are also examined, and the lock is placed in the middle of the run of
+    // ticks with the best correlation, so that sampling lands mid-bit.
+    uint8_t lock_ticks;
+    uint8_t lock_best_distance;
+    uint8_t lock_best_start;
+    uint8_t lock_best_end;
+    // The number of pulses read past the chosen alignment, which belong to
+    // the first symbol after the preamble.
+    uint8_t lock_overrun;
+    // Whether the candidate is a v1 preamble or a v2 sync word.
+    enum ASK_FRAME_FORMAT lock_format;
+};
+
+// Number of received frames that can be waiting for validation. Must be a
+// power of two.
+#define ASK_RX_QUEUE_DEPTH 4
+
+struct ask_reader_stats {
+    // Updated only by the reader callback.
+    volatile uint32_t frames_received;
+    // Frames thrown away because the completion queue was full.
+    volatile uint32_t frames_dropped;
+    // Frames thrown away as they started, because their length was over the
+    // pool's mtu (or ASK_MAX_PAYLOAD without a pool), or because no pool
+    // buffer was free.
+    volatile uint32_t frames_oversize;
+    volatile uint32_t pool_exhausted;
+    // Updated only by ask_reader_process().
+    uint32_t frames_ok;
+    uint32_t fcs_errors;
+    // Payload bytes repaired by FEC, and frames it could not repair.
+    uint32_t fec_corrected;
+    uint32_t fec_failures;
+    // Aggregated frames that passed the FCS, but whose length table didn't
+    // add up.
+    uint32_t aggregate_errors;
+    // Preambles whose rate was detected. Updated only by the reader callback.
+    volatile uint32_t rate_detections;
+};
+
+// Used when the reader is driven by line edges rather than polled. The run
+// of pulses at the current level is only decoded once it ends, so only the
+// time and level of the last edge need to be kept.
+struct ask_edge_state {
+    bool started;
+    uint8_t level;
+    uint32_t last_us;
+};
+
+// A run of one level this many divisions long leaves the preamble scan in
+// the same state however much longer it is, so the rest of it can be
+// skipped rather than fed through pulse by pulse.
+#define ASK_EDGE_MAX_RUN_DIVS ((8 * sizeof(preamble_t) + 1) * DIV_PER_BIT)
+
+// Rate detection, when ask_reader_params.max_us_per_div is set.
+//
+// The preamble is sent without a line code, so each of its runs of one
+// level is a known number of bits long, whatever the rate. So instead of
+// scanning pulses, the reader keeps the lengths of the last few runs of the
+// line, and at each edge checks whether they fit the runs of FRAME_PREAMBLE
+// (or FRAME_SYNC_V2) at some bit period: their total length over their total
+// bits gives the period, and then each run must be within a third of a bit
+// of its expected length. The first run is left out, since it may have run
+// on from whatever was on the line before, and so is the last, since it runs
+// on into the first symbol. A run shorter than half a bit at us_per_div is
+// taken as a glitch, and it and the run after it are added to the one before.
+//
+// On a match, the preamble up to its last run is replayed to the preamble
+// scan at the detected rate, and the rest of the frame is rebuilt from the
+// edges at that rate, just as ask_reader_edge() does at a fixed one. Once
+// the frame is read, or the preamble scan didn't lock after all, it goes
+// back to matching runs.
+#define ASK_RATE_MAX_RUNS 16
+// Pulses after a match within which the preamble scan must lock: its last
+// run, and the bit period taken to place the lock, with room to spare.
+#define ASK_RATE_LOCK_DIVS (8 * DIV_PER_BIT)
+
+struct ask_rate_pattern {
+    enum ASK_FRAME_FORMAT format;
+    // The bits as sent, MSB first, and how many come before the last run.
+    preamble_t word;
+    uint8_t num_bits;
+    uint8_t replay_bits;
+    // The runs matched, oldest first, in bits, and the level of the newest.
+    uint8_t run_bits[ASK_RATE_MAX_RUNS];
+    uint8_t num_runs;
+    uint8_t total_bits;
+    uint8_t last_level;
+};
+
+constexpr struct ask_rate_pattern __ask_rate_make_pattern(preamble_t word, uint8_t num_bits, enum ASK_FRAME_FORMAT format)
+{
+    struct ask_rate_pattern pattern = {};
+    pattern.format = format;
+    pattern.word = word;
+    pattern.num_bits = num_bits;
+
+    // Skip the first run, then take every run but the last.
+    uint8_t i = 0;
+    uint8_t first = (word >> (num_bits - 1)) & 1;
+    while (i < num_bits && ((word >> (num_bits - 1 - i)) & 1) == first)
+    {
+        i++;
+    }
+    while (i < num_bits)
+    {
+        uint8_t level = (word >> (num_bits - 1 - i)) & 1;
+        uint8_t start = i;
+        while (i < num_bits && ((word >> (num_bits - 1 - i)) & 1) == level)
+        {
+            i++;
+        }
+        if (i == num_bits)
+        {
+            pattern.replay_bits = start;
+            break;
+        }
+        pattern.run_bits[pattern.num_runs++] = i - start;
+        pattern.total_bits += i - start;
+        pattern.last_level = level;
+    }
+    return pattern;
+}
+
+static constexpr struct ask_rate_pattern ASK_RATE_PATTERNS[] = {
+    __ask_rate_make_pattern(FRAME_PREAMBLE, 8 * sizeof(preamble_t), ASK_FRAME_V1),
+    __ask_rate_make_pattern(FRAME_SYNC_V2, 8 * sizeof(uint16_t), ASK_FRAME_V2),
+};
+
+struct ask_rate_state {
+    // The lengths of the last runs of the line, the newest at run_head - 1.
+    uint32_t run_us[ASK_RATE_MAX_RUNS];
+    uint8_t run_head;
+    uint8_t num_runs;
+    // Whether the run before was a glitch, and this one carries on the one
+    // before that.
+    bool merging;
+    // The division period of the frame being read, or 0 while matching.
+    uint32_t div_ns;
+    // Pulses fed since the match, up to ASK_RATE_LOCK_DIVS.
+    uint32_t pulses;
+    // The time of the last sample, when polled rather than driven by edges.
+    uint32_t sample_us;
 };
 
 struct ask_reader {
@@ -137,6 +811,26 @@ struct ask_reader {
 
     struct ask_preamble_read_state preamble_state;
     struct ask_symbol_read_state symbol_state;
+    // The FCS of the frame so far, updated as each byte is read.
+    checksum_t fcs;
+    // Payload bytes of the current frame marked as erasures for FEC.
+    uint32_t num_erasures;
+    // These survive the reader being reset between frames.
+    struct ask_edge_state edge_state;
+    struct ask_rate_state rate_state;
+    // The pool buffer on loan to the reader, kept for the next frame when
+    // one is abandoned, since only the consumer may return it.
+    uint8_t* pool_buffer;
+
+    // Single-producer/single-consumer ring of frames that have been read in
+    // full, and are waiting for ask_reader_process() to validate and deliver
+    // them. The reader callback only advances the head, and the consumer
+    // only the tail. This survives the reader being reset between frames.
+    struct ask_frame completed[ASK_RX_QUEUE_DEPTH];
+    volatile uint32_t completed_head;
+    volatile uint32_t completed_tail;
+
+    struct ask_reader_stats stats;
 };
 
 struct ask_writer ask_writer_init(struct ask_writer_params params)
@@ -144,218 +838,806 @@ struct ask_writer ask_writer_init(struct ask_writer_params params)
     struct ask_writer writer;
     
     writer.params = params;
+    writer.queue_head = 0;
+    writer.queue_tail = 0;
+    writer.current = NULL;
     writer.num_bits = 0;
-    writer.bit_stream = NULL;
     writer.bit_cursor = 0;
-    writer.channel_ready = true; // Determines whether or not the channel is ready to accept a new packet. Set to false upon receipt, and blocks teh channel while the payload is prepared.
-    writer.data_ready = false; // Determines whether or not the channel has all necessary data prepared to begin sending.
+    writer.bit_word = 0;
+    writer.stream.num_segments = 0;
+    writer.gap_divs = 0;
+    writer.data_ready = false; // Determines whether or not a frame is in flight.
+    writer.busy = false;
+    writer.stats = {0,0,0,0,0};
+
+    // Every write fails with invalid FEC params, so say why once up front.
+    if (!ask_fec_valid(&params.fec))
+    {
+        fprintf(stderr, "FEC of %u parity bytes per %u byte block is invalid, so nothing will be sent\n",
+            params.fec.parity_bytes, params.fec.block_bytes);
+    }
     
     return writer;
 }
 
+// Return the reader back to preamble scanning, keeping the completion queue.
+void __ask_reader_reset(struct ask_reader* reader)
+{
+    reader->frame = {0,0,0,0,false,NULL,ASK_FRAME_V1,0,{0,0,0},0};
+    reader->preamble_state.pulse_window = 0;
+    reader->preamble_state.pulse_window_ones = 0;
+    reader->preamble_state.phase = 0;
+    reader->preamble_state.lock_ticks = 0;
+    reader->preamble_state.lock_best_distance = 0;
+    reader->preamble_state.lock_best_start = 0;
+    reader->preamble_state.lock_best_end = 0;
+    reader->preamble_state.lock_overrun = 0;
+    reader->preamble_state.lock_format = ASK_FRAME_V1;
+    for (int i = 0 ; i < DIV_PER_BIT ; i++)
+    {
+        reader->preamble_state.phase_preambles[i] = 0;
+    }
+
+    reader->stage = PREAMBLE_SCAN;
+    reader->symbol_state = {0,0,0,0,0,0,0,0,false,0,NULL};
+    reader->num_erasures = 0;
+
+    // Whatever preamble is locked onto, the sender's FCS covers the real one.
+    preamble_t preamble = FRAME_PREAMBLE;
+    reader->fcs = __ask_fcs_update(ASK_FCS_INIT, (uint8_t*)&preamble, sizeof(preamble_t));
+}
+
+// Let go of the payload of a frame the reader is abandoning. A pool buffer
+// stays with the reader for the next frame.
+void __ask_reader_discard(struct ask_reader* reader, struct ask_frame* frame)
+{
+    if (reader->params.pool != NULL)
+    {
+        return;
+    }
+    if (frame->data != NULL)
+    {
+        free(frame->data);
+    }
+    if (frame->erasures != NULL)
+    {
+        free(frame->erasures);
+    }
+}
+
+// Let go of a payload that the consumer won't be handed.
+void __ask_reader_release(struct ask_reader* reader, uint8_t* data)
+{
+    if (reader->params.pool != NULL)
+    {
+        ask_pool_return(reader->params.pool, data);
+    }
+    else
+    {
+        free(data);
+    }
+}
+
 struct ask_reader ask_reader_init(struct ask_reader_params params)
 {
     struct ask_reader reader;
 
     reader.params = params;
-    reader.frame = {0,0,0,0};
-    for (int i = 0 ; i < sizeof(preamble_t) ; i++)
+    __ask_reader_reset(&reader);
+
+    reader.completed_head = 0;
+    reader.completed_tail = 0;
+    reader.stats = {0,0,0,0,0,0,0,0,0,0};
+    reader.edge_state = {false,0,0};
+    reader.rate_state = {{0},0,0,false,0,0,0};
+    reader.pool_buffer = NULL;
+
+    if (!ask_fec_valid(&params.fec))
     {
-        reader.preamble_state.frame_preamble_pulses[i] = 0;
+        fprintf(stderr, "FEC of %u parity bytes per %u byte block is invalid, so nothing will be received\n",
+            params.fec.parity_bytes, params.fec.block_bytes);
     }
 
-    reader.stage = PREAMBLE_SCAN;
-    reader.symbol_state = {0,0,{0,0,0,0,0,0},0};
-
     return reader;
 }
 
-ask_len_t ask_encode_bytes(struct ask_writer* writer, uint8_t* bytes_in, ask_len_t numbytes, uint8_t* bits_out, bool use6bitsymbols = true)
+ask_len_t ask_encode_bytes(struct ask_writer* writer, uint8_t* bytes_in, ask_len_t numbytes, ask_pulse_word_t* bits_out, ask_len_t bit_offset, bool line_coded = true)
 {
-    ask_len_t bit_cursor = 0;
+    const struct ask_line_code* code = &ASK_LINE_CODES[writer->params.encoding];
+
+    // The output stream is expected to be zeroed, so only the divisions
+    // carrying a 1 need to be touched.
+    ask_len_t bit_cursor = bit_offset;
 
     for (int b = numbytes - 1 ; b >= 0; b--)
     {
         for (int n = 1; n >= 0 ; n--)
         {
             uint8_t nybble = (bytes_in[b] & (0xf << (n * 4))) >> (n * 4);
-            uint8_t bits = (use6bitsymbols ? SYMBOLS46[nybble] : nybble);
-            for (int i = (use6bitsymbols ? 6 : 4) - 1; i >= 0 ; i--)
+            uint8_t bits = (line_coded ? code->encode[nybble] : nybble);
+            for (int i = (line_coded ? code->symbol_bits : 4) - 1; i >= 0 ; i--)
             {
-                uint8_t bit = (bits & (1 << i)) >> i;
+                ask_pulse_word_t bit = (bits & (1 << i)) >> i;
                 for (int d = 0 ; d < DIV_PER_BIT; d++)
                 {
-                    bits_out[bit_cursor] = bit;
+                    bits_out[bit_cursor / ASK_PULSES_PER_WORD] |=
+                        bit << (bit_cursor % ASK_PULSES_PER_WORD);
                     bit_cursor++;
                 }
             }
         }
     }
 
-    return bit_cursor;
+    return bit_cursor - bit_offset;
+}
+
+// The bytes of v2 header for a payload, with or without flags.
+inline uint8_t __ask_v2_header_len(ask_len_t payload_byte_count, bool flags)
+{
+    return ((payload_byte_count << 1) + flags > 0x7f ? 2 : 1) + flags;
 }
 
-uint8_t* ask_encode_frame(struct ask_writer* writer, struct ask_frame* frame, ask_len_t* numbits_out)
+ask_len_t ask_frame_divisions(ask_len_t payload_byte_count, enum ENCODING encoding = BALANCED_REPEATED,
+    enum ASK_FRAME_FORMAT format = ASK_FRAME_V1, bool flags = false)
 {
-    // TODO There's an 8x memory overhead here since we're storing
-    // each pulse as a uint8_t, and not as a bit in an integer.
+    // The preamble is sent as raw 4-bit nybbles, everything else as symbols
+    // of the line code.
+    if (format == ASK_FRAME_V2 && payload_byte_count <= ASK_V2_MAX_PAYLOAD)
+    {
+        return (
+            sizeof(uint16_t) * 2 * 4 +
+            (__ask_v2_header_len(payload_byte_count, flags) + sizeof(checksum_t) + payload_byte_count) *
+                2 * ASK_LINE_CODES[encoding].symbol_bits
+            ) * DIV_PER_BIT;
+    }
+    return (
+        sizeof(preamble_t) * 2 * 4 + 
+        (sizeof(ask_len_t) + sizeof(checksum_t) + payload_byte_count) * 2 * ASK_LINE_CODES[encoding].symbol_bits
+        ) * DIV_PER_BIT;
+}
 
-    ask_len_t numbits = (
-        sizeof(preamble_t) + sizeof(ask_len_t) + sizeof(checksum_t) + 
-        frame->payload_byte_count) * 2 * 6 * DIV_PER_BIT;
+ask_pulse_word_t* ask_encode_frame(struct ask_writer* writer, struct ask_frame* frame, ask_len_t* numbits_out)
+{
+    ask_len_t numbits = ask_frame_divisions(frame->payload_byte_count, writer->params.encoding,
+        frame->format, frame->flags != 0);
     
     *numbits_out = numbits;
-    uint8_t* bit_stream = (uint8_t*)malloc(sizeof(uint8_t) * numbits);
+    ask_pulse_word_t* bit_stream = (ask_pulse_word_t*)calloc(
+        ASK_PULSE_WORDS(numbits), sizeof(ask_pulse_word_t));
     
     ask_len_t bit_cursor = 0;
 
+    if (frame->format == ASK_FRAME_V2)
+    {
+        bit_cursor += ask_encode_bytes(writer,
+            (uint8_t*)&frame->preamble, sizeof(uint16_t), bit_stream, bit_cursor, false);
+        for (uint8_t i = 0 ; i < frame->header_len ; i++)
+        {
+            bit_cursor += ask_encode_bytes(writer, &frame->header[i], 1, bit_stream, bit_cursor);
+        }
+    }
+    else
+    {
+        bit_cursor += ask_encode_bytes(writer,
+            (uint8_t*)&frame->preamble, sizeof(preamble_t), bit_stream, bit_cursor, false);
+        bit_cursor += ask_encode_bytes(writer,
+            (uint8_t*)&frame->payload_byte_count, sizeof(ask_len_t), bit_stream, bit_cursor);
+    }
     bit_cursor += ask_encode_bytes(writer,
-        (uint8_t*)&frame->preamble, sizeof(preamble_t), bit_stream + bit_cursor, false);
-    bit_cursor += ask_encode_bytes(writer,
-        (uint8_t*)&frame->payload_byte_count, sizeof(ask_len_t), bit_stream + bit_cursor);
-    bit_cursor += ask_encode_bytes(writer,
-        frame->data, frame->payload_byte_count, bit_stream + bit_cursor);
+        frame->data, frame->payload_byte_count, bit_stream, bit_cursor);
     bit_cursor += ask_encode_bytes(writer,
-        (uint8_t*)&frame->checksum, sizeof(checksum_t), bit_stream + bit_cursor);
+        (uint8_t*)&frame->checksum, sizeof(checksum_t), bit_stream, bit_cursor);
 
     return bit_stream;
 }
 
-checksum_t __ask_fcs_calculate(struct ask_frame* frame)
+checksum_t __ask_fcs_header(struct ask_frame* frame)
 {
-    checksum_t fcs = 0;
-    for (int i = 0 ; i < sizeof(preamble_t) ; i++)
+    checksum_t fcs = ASK_FCS_INIT;
+    if (frame->format == ASK_FRAME_V2)
     {
-        fcs ^= ((uint8_t*)(&frame->preamble))[i];
+        fcs = __ask_fcs_update(fcs, (uint8_t*)(&frame->preamble), sizeof(uint16_t));
+        for (uint8_t i = 0 ; i < frame->header_len ; i++)
+        {
+            fcs = __ask_fcs_update_byte(fcs, frame->header[i]);
+        }
+        return fcs;
     }
+    fcs = __ask_fcs_update(fcs, (uint8_t*)(&frame->preamble), sizeof(preamble_t));
+    fcs = __ask_fcs_update(fcs, (uint8_t*)(&frame->payload_byte_count), sizeof(ask_len_t));
+    return fcs;
+}
+
+checksum_t __ask_fcs_calculate(struct ask_frame* frame)
+{
+    return __ask_fcs_finish(__ask_fcs_update(__ask_fcs_header(frame), frame->data, frame->payload_byte_count));
+}
 
-    for (int i = 0 ; i < sizeof(ask_len_t); i++)
+// Fill in everything about a frame ahead of its payload: its format, the
+// preamble or sync word, and the length and flags, which for v2 make up the
+// header.
+void __ask_frame_header(struct ask_writer* writer, struct ask_frame* frame, ask_len_t datalen, uint8_t flags)
+{
+    frame->payload_byte_count = datalen;
+    frame->flags = 0;
+    frame->header_len = 0;
+    if (writer->params.format != ASK_FRAME_V2 || datalen > ASK_V2_MAX_PAYLOAD)
     {
-        fcs ^= ((uint8_t*)(&frame->payload_byte_count))[i];
+        frame->format = ASK_FRAME_V1;
+        frame->preamble = FRAME_PREAMBLE;
+        return;
     }
 
-    for (int i = 0 ; i < frame->payload_byte_count; i++)
+    frame->format = ASK_FRAME_V2;
+    frame->flags = flags;
+    frame->preamble = FRAME_SYNC_V2;
+    uint16_t value = (datalen << 1) | (flags != 0);
+    if (value > 0x7f)
     {
-        fcs ^= frame->data[i];
+        frame->header[frame->header_len++] = (value & 0x7f) | 0x80;
+        frame->header[frame->header_len++] = value >> 7;
+    }
+    else
+    {
+        frame->header[frame->header_len++] = value;
+    }
+    if (flags != 0)
+    {
+        frame->header[frame->header_len++] = flags;
     }
-
-    return fcs;
 }
 
-struct ask_frame ask_encap_payload(struct ask_writer* writer, uint8_t* data, ask_len_t datalen)
+struct ask_frame ask_encap_payload(struct ask_writer* writer, uint8_t* data, ask_len_t datalen, uint8_t flags = 0)
 {
     struct ask_frame frame;
-    frame.preamble = FRAME_PREAMBLE;
-    frame.payload_byte_count = datalen;
+    __ask_frame_header(writer, &frame, datalen, flags);
     frame.data = data;
     frame.checksum = __ask_fcs_calculate(&frame);
+    frame.fcs_ok = true;
+    frame.erasures = NULL;
 
     return frame;
 }
 
-int32_t ask_write(struct ask_writer* writer, uint8_t* data, ask_len_t datalen, bool async = false)
+inline void __ask_stream_load_symbol(struct ask_stream_cursor* stream)
+{
+    struct ask_stream_segment* seg = &stream->segments[stream->segment];
+    uint8_t nybble = (seg->data[stream->byte] >> (stream->nybble * 4)) & 0xf;
+    stream->symbol = (seg->line_coded ? stream->code->encode[nybble] : nybble);
+    stream->symbol_bit = (seg->line_coded ? stream->code->symbol_bits : 4) - 1;
+}
+
+inline void __ask_stream_next_symbol(struct ask_stream_cursor* stream)
 {
-    if (!writer->channel_ready)
+    if (stream->nybble == 1)
     {
-        return -1;
+        stream->nybble = 0;
     }
     else
     {
-        // Precompute the bit stream to send, and store that.
-        // Saves time spent in the interrupt handler which needs to be as lean as possible.
-
-        // Mark the channel as not ready, prevents anyone else sending data.
-        writer->channel_ready = false;
-
-        struct ask_frame frame = ask_encap_payload(writer, data, datalen);
-        writer->bit_stream = ask_encode_frame(writer, &frame, &writer->num_bits);
-        writer->bit_cursor = 0;
-        writer->data_ready = true;
-
-        if (async)
+        stream->nybble = 1;
+        stream->byte--;
+        // Skip over exhausted (and empty) segments.
+        while (stream->byte < 0)
         {
-            return 0;
-        }
-        else
-        {
-            // Estimate the time to transmit the packet based on the length
-            // and writer parameters.
-            uint32_t us_to_transmit = writer->num_bits * writer->params.us_per_div;
-            
-            while (!writer->channel_ready)
+            stream->segment++;
+            if (stream->segment == stream->num_segments)
             {
-                std::this_thread::sleep_for(std::chrono::microseconds(us_to_transmit / 10));
+                return;
             }
-
-            return datalen;
+            stream->byte = stream->segments[stream->segment].len - 1;
         }
     }
+
+    __ask_stream_load_symbol(stream);
 }
 
-void ask_writer_callback(struct ask_writer* writer)
+void __ask_stream_init(struct ask_stream_cursor* stream, enum ENCODING encoding, struct ask_frame* frame, const struct ask_iovec* iov, int iovcnt)
 {
-    if (writer->data_ready)
+    stream->code = &ASK_LINE_CODES[encoding];
+    stream->num_segments = 0;
+    if (frame->format == ASK_FRAME_V2)
     {
-        uint8_t bit = writer->bit_stream[writer->bit_cursor];
-        writer->params.write(bit);
-        
-        writer->bit_cursor++;
-
-        if (writer->bit_cursor == writer->num_bits)
+        stream->segments[stream->num_segments++] = {(uint8_t*)&frame->preamble, sizeof(uint16_t), false};
+        for (uint8_t i = 0 ; i < frame->header_len ; i++)
         {
-            writer->data_ready = false;
-            writer->num_bits = 0;
-            writer->bit_cursor = 0;
-            free(writer->bit_stream);
-            writer->channel_ready = true;
+            stream->segments[stream->num_segments++] = {&frame->header[i], 1, true};
         }
     }
+    else
+    {
+        stream->segments[stream->num_segments++] = {(uint8_t*)&frame->preamble, sizeof(preamble_t), false};
+        stream->segments[stream->num_segments++] = {(uint8_t*)&frame->payload_byte_count, sizeof(ask_len_t), true};
+    }
+    for (int i = iovcnt - 1 ; i >= 0 ; i--)
+    {
+        stream->segments[stream->num_segments++] = {iov[i].data, iov[i].len, true};
+    }
+    stream->segments[stream->num_segments++] = {(uint8_t*)&frame->checksum, sizeof(checksum_t), true};
+
+    // The preamble is never empty, so the first symbol can be loaded directly.
+    stream->segment = 0;
+    stream->byte = stream->segments[0].len - 1;
+    stream->nybble = 1;
+    stream->div = 0;
+    __ask_stream_load_symbol(stream);
 }
 
-inline void __ask_read_pulse(struct ask_symbol_read_state* state, uint8_t pulse)
+// Produce the next division of the frame, and advance the cursor.
+inline uint8_t __ask_stream_next_division(struct ask_stream_cursor* stream)
 {
-    state->pulses[state->num_pulses_read / DIV_PER_BIT] += 
-        (pulse << (state->num_pulses_read % DIV_PER_BIT));
-    state->num_pulses_read++;
-}
+    uint8_t bit = (stream->symbol >> stream->symbol_bit) & 1;
 
-inline uint8_t __ask_process_symbol(struct ask_symbol_read_state* state)
-{
-    if (state->num_pulses_read == (6 * DIV_PER_BIT))
+    stream->div++;
+    if (stream->div == DIV_PER_BIT)
     {
-        uint8_t symbol = 0;
-        for (int i = 0 ; i < 6 ; i++)
+        stream->div = 0;
+        stream->symbol_bit--;
+        if (stream->symbol_bit < 0)
         {
-            uint8_t bit = (ONES_PER_BYTE[state->pulses[i]] >= 5);
-            symbol += (bit << (5-i));
+            __ask_stream_next_symbol(stream);
         }
-        return SYMBOLS64[symbol];
-    }
-    else
-    {
-        // A specific value indicating that insufficient reads have
-        // completed to fill the symbol.
-        return 0xff;
     }
+
+    return bit;
 }
 
-void __ask_symbol_state_reset(struct ask_symbol_read_state* state)
+// The number of frames queued or in flight.
+inline uint32_t ask_writer_queue_depth(struct ask_writer* writer)
+{
+    return writer->queue_head - writer->queue_tail;
+}
+
+// Whether the queue has room for another frame.
+inline bool ask_writer_ready(struct ask_writer* writer)
+{
+    return ask_writer_queue_depth(writer) < ASK_TX_QUEUE_DEPTH;
+}
+
+// Whether every queued frame has been sent.
+inline bool ask_writer_flushed(struct ask_writer* writer)
+{
+    return ask_writer_queue_depth(writer) == 0;
+}
+
+// Claim the next free slot in the transmit queue, or NULL if it is full.
+struct ask_tx_frame* __ask_tx_claim(struct ask_writer* writer)
 {
-    state->num_pulses_read = 0;
-    for(int i = 0 ; i < 6; i++)
+    if (!ask_writer_ready(writer))
     {
-        state->pulses[i] = 0;
+        writer->stats.queue_full++;
+        return NULL;
     }
+
+    return &writer->queue[writer->queue_head % ASK_TX_QUEUE_DEPTH];
 }
 
-void ask_read_symbols(struct ask_reader* reader, uint8_t pulse)
+// Publish the claimed slot to the writer callback, returning its sequence.
+uint32_t __ask_tx_publish(struct ask_writer* writer)
 {
-    // For each pulse, first read the pulse into the right buffer.
-    __ask_read_pulse(&reader->symbol_state, pulse);
+    uint32_t sequence = writer->queue_head;
+
+    // The slot contents must be visible before the callback can see it.
+    std::atomic_thread_fence(std::memory_order_release);
+    writer->queue_head = sequence + 1;
+
+    writer->stats.frames_queued++;
+    uint32_t depth = ask_writer_queue_depth(writer);
+    if (depth > writer->stats.max_queue_depth)
+    {
+        writer->stats.max_queue_depth = depth;
+    }
+
+    return sequence;
+}
+
+int32_t __ask_write_wait(struct ask_writer* writer, uint32_t sequence, ask_len_t num_bits, ask_len_t datalen)
+{
+    // Estimate the time to transmit the packet based on the length
+    // and writer parameters.
+    uint32_t us_to_transmit = num_bits * writer->params.us_per_div;
+    
+    // The frame is done once the callback has moved the tail past it.
+    while ((int32_t)(writer->queue_tail - sequence) <= 0)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(us_to_transmit / 10));
+    }
+
+    return datalen;
+}
+
+// FEC encode a payload gathered from several pieces into a new buffer, or
+// return NULL if the FEC params are invalid or out of memory.
+uint8_t* __ask_fec_encode_iov(struct ask_writer* writer, const struct ask_iovec* iov, int iovcnt, ask_len_t* encoded_len)
+{
+    ask_len_t datalen = 0;
+    for (int i = 0 ; i < iovcnt ; i++)
+    {
+        datalen += iov[i].len;
+    }
+
+    // The code needs the whole payload at once, so the pieces are copied
+    // together first.
+    *encoded_len = ask_fec_encoded_len(&writer->params.fec, datalen);
+    if (*encoded_len < 0)
+    {
+        return NULL;
+    }
+    uint8_t* gathered = (uint8_t*)malloc(datalen + 1);
+    uint8_t* encoded = (uint8_t*)malloc(*encoded_len + 1);
+    if (gathered == NULL || encoded == NULL)
+    {
+        free(gathered);
+        free(encoded);
+        return NULL;
+    }
+    ask_len_t offset = 0;
+    for (int i = 0 ; i < iovcnt ; i++)
+    {
+        memcpy(gathered + offset, iov[i].data, iov[i].len);
+        offset += iov[i].len;
+    }
+
+    if (!ask_fec_encode(&writer->params.fec, gathered, datalen, encoded))
+    {
+        free(encoded);
+        encoded = NULL;
+    }
+    free(gathered);
+
+    return encoded;
+}
+
+// Send a datagram gathered from several pieces, without copying them
+// together or expanding the frame. The pieces are read directly from the
+// writer callback, so must outlive the transmission when async is set.
+// flags are only sent in a v2 frame.
+int32_t ask_write_iov(struct ask_writer* writer, const struct ask_iovec* iov, int iovcnt, bool async = false,
+    uint8_t flags = 0)
+{
+    if (iovcnt > ASK_MAX_IOV)
+    {
+        return -1;
+    }
+
+    struct ask_tx_frame* tx = __ask_tx_claim(writer);
+    if (tx == NULL)
+    {
+        return -1;
+    }
+
+    ask_len_t datalen = 0;
+    for (int i = 0 ; i < iovcnt ; i++)
+    {
+        datalen += iov[i].len;
+        tx->iov[i] = iov[i];
+    }
+    tx->iovcnt = iovcnt;
+    tx->fec_data = NULL;
+
+    // With FEC, the encoded copy is streamed in place of the pieces.
+    ask_len_t onair_len = datalen;
+    if (ask_fec_enabled(&writer->params.fec))
+    {
+        tx->fec_data = __ask_fec_encode_iov(writer, iov, iovcnt, &onair_len);
+        if (tx->fec_data == NULL)
+        {
+            return -1;
+        }
+        tx->iov[0] = {tx->fec_data, onair_len};
+        tx->iovcnt = 1;
+    }
+
+    __ask_frame_header(writer, &tx->frame, onair_len, flags);
+    tx->frame.data = NULL;
+    tx->frame.erasures = NULL;
+    // The pieces go on air last piece first.
+    checksum_t fcs = __ask_fcs_header(&tx->frame);
+    for (int i = tx->iovcnt - 1 ; i >= 0 ; i--)
+    {
+        fcs = __ask_fcs_update(fcs, tx->iov[i].data, tx->iov[i].len);
+    }
+    tx->frame.checksum = __ask_fcs_finish(fcs);
+
+    tx->bit_stream = NULL;
+    tx->num_bits = ask_frame_divisions(onair_len, writer->params.encoding, tx->frame.format, tx->frame.flags != 0);
+
+    uint32_t sequence = __ask_tx_publish(writer);
+
+    if (async)
+    {
+        return 0;
+    }
+    else
+    {
+        return __ask_write_wait(writer, sequence, tx->num_bits, datalen);
+    }
+}
+
+int32_t ask_write(struct ask_writer* writer, uint8_t* data, ask_len_t datalen, bool async = false)
+{
+    if (writer->params.streaming)
+    {
+        struct ask_iovec iov = {data, datalen};
+        return ask_write_iov(writer, &iov, 1, async);
+    }
+
+    struct ask_tx_frame* tx = __ask_tx_claim(writer);
+    if (tx == NULL)
+    {
+        return -1;
+    }
+    else
+    {
+        // Precompute the bit stream to send, and store that.
+        // Saves time spent in the interrupt handler which needs to be as lean as possible.
+        tx->fec_data = NULL;
+        if (ask_fec_enabled(&writer->params.fec))
+        {
+            struct ask_iovec iov = {data, datalen};
+            ask_len_t encoded_len;
+            tx->fec_data = __ask_fec_encode_iov(writer, &iov, 1, &encoded_len);
+            if (tx->fec_data == NULL)
+            {
+                return -1;
+            }
+            tx->frame = ask_encap_payload(writer, tx->fec_data, encoded_len);
+        }
+        else
+        {
+            tx->frame = ask_encap_payload(writer, data, datalen);
+        }
+        tx->iovcnt = 0;
+        tx->bit_stream = ask_encode_frame(writer, &tx->frame, &tx->num_bits);
+
+        uint32_t sequence = __ask_tx_publish(writer);
+
+        if (async)
+        {
+            return 0;
+        }
+        else
+        {
+            return __ask_write_wait(writer, sequence, tx->num_bits, datalen);
+        }
+    }
+}
+
+// Send a frame that has already been encoded into a pulse stream, for
+// example by an AskCodec with a different configuration to this writer's.
+// The writer takes ownership of bit_stream, which must be from malloc().
+// Returns num_bits once sent (0 straight away when async), or -1 if the
+// queue is full, in which case bit_stream still belongs to the caller.
+int32_t ask_write_pulses(struct ask_writer* writer, ask_pulse_word_t* bit_stream, ask_len_t num_bits, bool async = false)
+{
+    struct ask_tx_frame* tx = __ask_tx_claim(writer);
+    if (tx == NULL)
+    {
+        return -1;
+    }
+
+    tx->frame = {0,0,0,0,false,NULL,ASK_FRAME_V1,0,{0,0,0},0};
+    tx->iovcnt = 0;
+    tx->fec_data = NULL;
+    tx->bit_stream = bit_stream;
+    tx->num_bits = num_bits;
+
+    uint32_t sequence = __ask_tx_publish(writer);
+
+    if (async)
+    {
+        return 0;
+    }
+    else
+    {
+        return __ask_write_wait(writer, sequence, num_bits, num_bits);
+    }
+}
+
+// Start sending the frame at the tail of the queue, if there is one.
+bool __ask_tx_start(struct ask_writer* writer)
+{
+    if (writer->queue_tail == writer->queue_head)
+    {
+        return false;
+    }
+
+    // Pairs with the release in __ask_tx_publish().
+    std::atomic_thread_fence(std::memory_order_acquire);
+    struct ask_tx_frame* tx = &writer->queue[writer->queue_tail % ASK_TX_QUEUE_DEPTH];
+
+    writer->current = tx;
+    writer->num_bits = tx->num_bits;
+    writer->bit_cursor = 0;
+    if (tx->bit_stream != NULL)
+    {
+        writer->bit_word = tx->bit_stream[0];
+    }
+    else
+    {
+        __ask_stream_init(&writer->stream, writer->params.encoding, &tx->frame, tx->iov, tx->iovcnt);
+    }
+    writer->data_ready = true;
+
+    return true;
+}
+
+void ask_writer_callback(struct ask_writer* writer)
+{
+    if (!writer->data_ready)
+    {
+        // Hold the channel low for the gap between frames.
+        if (writer->gap_divs > 0)
+        {
+            writer->params.write(0);
+            writer->gap_divs--;
+            return;
+        }
+
+        // Then move straight on to the next queued frame, if any.
+        if (!__ask_tx_start(writer))
+        {
+            if (writer->busy)
+            {
+                writer->busy = false;
+                writer->stats.underruns++;
+            }
+            return;
+        }
+        writer->busy = true;
+    }
+
+    struct ask_tx_frame* tx = writer->current;
+    if (tx->bit_stream == NULL)
+    {
+        writer->params.write(__ask_stream_next_division(&writer->stream));
+    }
+    else
+    {
+        writer->params.write(writer->bit_word & 1);
+        writer->bit_word >>= 1;
+    }
+    
+    writer->bit_cursor++;
+
+    if (writer->bit_cursor == writer->num_bits)
+    {
+        writer->data_ready = false;
+        writer->num_bits = 0;
+        writer->bit_cursor = 0;
+        writer->bit_word = 0;
+        if (tx->bit_stream != NULL)
+        {
+            free(tx->bit_stream);
+            tx->bit_stream = NULL;
+        }
+        if (tx->fec_data != NULL)
+        {
+            free(tx->fec_data);
+            tx->fec_data = NULL;
+        }
+        writer->current = NULL;
+        writer->gap_divs = writer->params.inter_frame_divs;
+
+        // Hand the slot back to the producer.
+        std::atomic_thread_fence(std::memory_order_release);
+        writer->queue_tail = writer->queue_tail + 1;
+        writer->stats.frames_sent = writer->stats.frames_sent + 1;
+    }
+    else if (tx->bit_stream != NULL && writer->bit_cursor % ASK_PULSES_PER_WORD == 0)
+    {
+        // Pull in the next word only once every 32 divisions.
+        writer->bit_word = tx->bit_stream[writer->bit_cursor / ASK_PULSES_PER_WORD];
+    }
+}
+
+inline void __ask_read_pulse(struct ask_symbol_read_state* state, uint8_t pulse)
+{
+    state->bit_ones += pulse;
+
+    if (pulse != state->last_pulse)
+    {
+        // Positive if the ramp wrapped too early, negative if too late.
+        int16_t error = state->pll_ramp - ASK_PLL_RAMP_INC / 2;
+        if (error >= ASK_PLL_RAMP_TRANSITION)
+        {
+            error -= ASK_PLL_RAMP_LEN;
+        }
+
+        state->pll_pending = (state->run_length >= 2);
+        state->pll_error = error;
+        state->last_pulse = pulse;
+        state->run_length = 1;
+    }
+    else
+    {
+        if (state->pll_pending)
+        {
+            state->pll_ramp -= state->pll_error / ASK_PLL_GAIN_DIV;
+            state->pll_pending = false;
+        }
+
+        if (state->run_length < 0xff)
+        {
+            state->run_length++;
+        }
+    }
+
+    state->pll_ramp += ASK_PLL_RAMP_INC;
+
+    if (state->pll_ramp >= ASK_PLL_RAMP_LEN)
+    {
+        state->symbol = (state->symbol << 1) | (state->bit_ones >= ASK_SYMBOL_ONES_THRESHOLD);
+        state->symbol_bits++;
+        state->bit_ones = 0;
+        state->pll_ramp -= ASK_PLL_RAMP_LEN;
+    }
+}
+
+inline uint8_t __ask_process_symbol(struct ask_symbol_read_state* state)
+{
+    if (state->symbol_bits == state->code->symbol_bits)
+    {
+        return state->code->decode[state->symbol];
+    }
+    else
+    {
+        // A specific value indicating that insufficient reads have
+        // completed to fill the symbol.
+        return 0xff;
+    }
+}
+
+// Start on the next symbol. The bit timing carries on across symbols.
+void __ask_symbol_state_reset(struct ask_symbol_read_state* state)
+{
+    state->symbol = 0;
+    state->symbol_bits = 0;
+}
+
+// Start reading symbols of the given line code, with the bit timing aligned
+// to the next pulse, which follows a pulse of level last_pulse.
+void __ask_symbol_state_sync(struct ask_symbol_read_state* state, uint8_t last_pulse, enum ENCODING encoding = BALANCED_REPEATED)
+{
+    __ask_symbol_state_reset(state);
+    state->code = &ASK_LINE_CODES[encoding];
+    state->bit_ones = 0;
+    state->last_pulse = last_pulse;
+    state->run_length = DIV_PER_BIT;
+    state->pll_ramp = ASK_PLL_RAMP_INC / 2;
+    state->pll_pending = false;
+    state->pll_error = 0;
+}
+
+void ask_read_symbols(struct ask_reader* reader, uint8_t pulse)
+{
+    // For each pulse, first read the pulse into the right buffer.
+    __ask_read_pulse(&reader->symbol_state, pulse);
 
     // Then check to see if the buffer is ready for processing.
     // Then process the symbol, as 6-bit or 4-bit,
     uint8_t nybble = __ask_process_symbol(&reader->symbol_state);
+
+    // With FEC, a bad symbol in the payload marks its byte as an erasure for
+    // the decoder to fill in, rather than costing the whole frame, as long
+    // as there is enough parity left to repair it.
+    if (nybble == 0xf0 && reader->stage == PAYLOAD_READ && reader->frame.erasures != NULL)
+    {
+        ask_len_t byte = (reader->symbol_state.num_symbols - 1) / 2;
+        if (!((reader->frame.erasures[byte / 8] >> (byte % 8)) & 1))
+        {
+            reader->frame.erasures[byte / 8] |= 1 << (byte % 8);
+            reader->num_erasures++;
+        }
+
+        ask_len_t parity = reader->frame.payload_byte_count -
+            ask_fec_decoded_len(&reader->params.fec, reader->frame.payload_byte_count);
+        if (reader->num_erasures <= (uint32_t)parity)
+        {
+            nybble = 0;
+        }
+    }
+
     // As long as the nybble is invalid, do not process.
     if (nybble >= 0xf0)
     {
@@ -369,13 +1651,10 @@ void ask_read_symbols(struct ask_reader* reader, uint8_t pulse)
         {
             reader->params.datagram_ready(NULL, 0);
             // The only dynamic memory we might have allocated is the 
-            // frame payload, so free that.
-            if (reader->frame.data != NULL)
-            {
-                free(reader->frame.data);
-            }
+            // frame payload, so let go of that.
+            __ask_reader_discard(reader, &reader->frame);
             // Return the reader back to preamble scanning.
-            *reader = ask_reader_init(reader->params);
+            __ask_reader_reset(reader);
         }
 
         return;
@@ -384,6 +1663,13 @@ void ask_read_symbols(struct ask_reader* reader, uint8_t pulse)
     // Then write the nybble to the output
     reader->symbol_state.output[((reader->symbol_state.num_symbols - 1) / 2)] +=
         nybble << 4 * ((reader->symbol_state.num_symbols - 1) % 2);
+
+    // The low nybble completes a byte, which goes straight into the FCS.
+    if ((reader->symbol_state.num_symbols - 1) % 2 == 0 && reader->stage != FCS_READ)
+    {
+        reader->fcs = __ask_fcs_update_byte(reader->fcs,
+            reader->symbol_state.output[(reader->symbol_state.num_symbols - 1) / 2]);
+    }
     reader->symbol_state.num_symbols--;
     __ask_symbol_state_reset(&reader->symbol_state);
 
@@ -395,122 +1681,471 @@ void ask_read_symbols(struct ask_reader* reader, uint8_t pulse)
     }
 
     // Then handle stage completion.
+    if (reader->stage == HEADER_READ)
+    {
+        struct ask_frame* frame = &reader->frame;
+        frame->header_len++;
+
+        // The length varint, then the flags byte if the length says there
+        // is one. A second length byte with its top bit set would make the
+        // length too long for a v2 frame, so must be corrupt.
+        uint8_t length_bytes = ((frame->header[0] & 0x80) ? 2 : 1);
+        if (length_bytes == 2 && frame->header_len == 2 && (frame->header[1] & 0x80))
+        {
+            reader->params.datagram_ready(NULL, 0);
+            __ask_reader_reset(reader);
+            return;
+        }
+        uint16_t value = frame->header[0] & 0x7f;
+        if (frame->header_len >= 2 && length_bytes == 2)
+        {
+            value |= frame->header[1] << 7;
+        }
+        uint8_t header_len = length_bytes;
+        if (frame->header_len >= length_bytes && (value & 1))
+        {
+            header_len++;
+        }
+        if (frame->header_len < header_len)
+        {
+            __ask_symbol_state_reset(&reader->symbol_state);
+            reader->symbol_state.num_symbols = 2;
+            reader->symbol_state.output = &frame->header[frame->header_len];
+            return;
+        }
+
+        frame->payload_byte_count = value >> 1;
+        frame->flags = ((value & 1) ? frame->header[length_bytes] : 0);
+#if ASK_TRACE
+        fprintf(stderr, "HEADER %d bytes, flags %#x\n", frame->header_len, frame->flags);
+#endif
+        // The rest is as for a v1 frame once its length is read.
+        reader->stage = PAYLOAD_LENGTH_READ;
+    }
+
     if (reader->stage == PAYLOAD_LENGTH_READ)
     {
+#if ASK_TRACE
         fprintf(stderr, "PAYLOAD_LENGTH %d\n", reader->frame.payload_byte_count);
+#endif
         reader->stage = PAYLOAD_LENGTH_READ_COMPLETE;
-        reader->frame.data = (uint8_t*)calloc(reader->frame.payload_byte_count, sizeof(uint8_t*));
+        if (ask_fec_enabled(&reader->params.fec) &&
+            ask_fec_decoded_len(&reader->params.fec, reader->frame.payload_byte_count) < 0)
+        {
+            // No payload FEC encodes to this length, so it must be corrupt.
+            reader->params.datagram_ready(NULL, 0);
+            __ask_reader_reset(reader);
+            return;
+        }
+
+        struct ask_pool* pool = reader->params.pool;
+        ask_len_t mtu = (pool != NULL ? pool->mtu : ASK_MAX_PAYLOAD);
+        if (reader->frame.payload_byte_count > mtu)
+        {
+            reader->stats.frames_oversize = reader->stats.frames_oversize + 1;
+            reader->params.datagram_ready(NULL, 0);
+            __ask_reader_reset(reader);
+            return;
+        }
+
+        // Nor can a corrupt length that is negative. An empty payload is fine.
+        if (reader->frame.payload_byte_count < 0)
+        {
+            reader->params.datagram_ready(NULL, 0);
+            __ask_reader_reset(reader);
+            return;
+        }
+
+        ask_len_t erasure_bytes = (reader->frame.payload_byte_count + 7) / 8 + 1;
+        if (pool != NULL)
+        {
+            if (reader->pool_buffer == NULL)
+            {
+                reader->pool_buffer = __ask_pool_loan(pool);
+            }
+            if (reader->pool_buffer == NULL)
+            {
+                reader->stats.pool_exhausted = reader->stats.pool_exhausted + 1;
+                reader->params.datagram_ready(NULL, 0);
+                __ask_reader_reset(reader);
+                return;
+            }
+
+            // Symbols are added into the payload, so it has to start zeroed.
+            reader->frame.data = reader->pool_buffer;
+            memset(reader->frame.data, 0, reader->frame.payload_byte_count);
+            if (ask_fec_enabled(&reader->params.fec))
+            {
+                reader->frame.erasures = reader->pool_buffer + pool->mtu;
+                memset(reader->frame.erasures, 0, erasure_bytes);
+            }
+        }
+        else
+        {
+            reader->frame.data = (uint8_t*)calloc(reader->frame.payload_byte_count + 1, sizeof(uint8_t));
+            if (reader->frame.data == NULL)
+            {
+                reader->params.datagram_ready(NULL, 0);
+                __ask_reader_reset(reader);
+                return;
+            }
+            if (ask_fec_enabled(&reader->params.fec))
+            {
+                reader->frame.erasures = (uint8_t*)calloc(erasure_bytes, sizeof(uint8_t));
+            }
+        }
         reader->stage = PAYLOAD_READ;
 
         __ask_symbol_state_reset(&reader->symbol_state);
         reader->symbol_state.num_symbols = 2 * reader->frame.payload_byte_count;
         reader->symbol_state.output = reader->frame.data;
     }
-    else if (reader->stage == PAYLOAD_READ)
+
+    // An empty payload has no symbols, so goes straight on to the FCS.
+    if (reader->stage == PAYLOAD_READ && reader->symbol_state.num_symbols == 0)
     {
+#if ASK_TRACE
         fprintf(stderr, "PAYLOAD %s\n", reader->frame.data);
+#endif
         reader->stage = PAYLOAD_READ_COMPLETE;
         reader->stage = FCS_READ;
 
         __ask_symbol_state_reset(&reader->symbol_state);
         reader->symbol_state.num_symbols = 2 * sizeof(checksum_t);
-        reader->symbol_state.output = &reader->frame.checksum;
+        reader->symbol_state.output = (uint8_t*)&reader->frame.checksum;
     }
-    else if (reader->stage = FCS_READ)
+    else if (reader->stage == FCS_READ)
     {
+#if ASK_TRACE
         fprintf(stderr, "FCS %#x\n", reader->frame.checksum);
+#endif
+        reader->frame.fcs_ok = (__ask_fcs_finish(reader->fcs) == reader->frame.checksum);
         reader->stage = FCS_READ_COMPLETE;
     }
 }
 
+inline uint8_t __ask_preamble_distance(preamble_t preamble, enum ASK_FRAME_FORMAT format = ASK_FRAME_V1)
+{
+    // A v2 sync word is only the last 16 bits.
+    preamble_t diff = (format == ASK_FRAME_V2 ? (preamble ^ FRAME_SYNC_V2) & 0xffff : preamble ^ FRAME_PREAMBLE);
+    uint8_t distance = 0;
+    for (size_t i = 0 ; i < sizeof(preamble_t) ; i++)
+    {
+        distance += ONES_PER_BYTE[(diff >> (8 * i)) & 0xff];
+    }
+    return distance;
+}
+
 void hex_print_preamble_buffer(struct ask_reader* reader)
 {
-    for (int i = sizeof(preamble_t) - 1 ; i >= 0 ; i--)
+    for (int i = DIV_PER_BIT - 1 ; i >= 0 ; i--)
     {
-        fprintf(stderr, "%#0.16lx ", reader->preamble_state.frame_preamble_pulses[i]);
+        fprintf(stderr, "%#.8x ", reader->preamble_state.phase_preambles[i]);
     }
     fprintf(stderr, "\n");
 }
 
-preamble_t __ask_pulses_to_bytes(uint8_t* bytes, ask_len_t num_bytes)
+void ask_read_preamble(struct ask_reader* reader, uint8_t pulse)
+{   
+    // hex_print_preamble_buffer(reader);
+    struct ask_preamble_read_state* state = &reader->preamble_state;
+
+    // Step 1: slide the one-bit window along by a pulse, keeping the count
+    // of high pulses in it up to date from the pulse entering and leaving.
+    uint8_t outgoing = (state->pulse_window >> (DIV_PER_BIT - 1)) & 1;
+    state->pulse_window = (state->pulse_window << 1) | pulse;
+    state->pulse_window_ones += pulse - outgoing;
+
+    // Step 2: the window now completes a bit for the current phase, so shift
+    // that bit into the preamble as seen at this phase.
+    preamble_t preamble = (state->phase_preambles[state->phase] << 1) |
+        (state->pulse_window_ones >= ASK_PREAMBLE_ONES_THRESHOLD);
+    state->phase_preambles[state->phase] = preamble;
+    state->phase = (state->phase + 1 == DIV_PER_BIT ? 0 : state->phase + 1);
+
+    reader->frame.preamble = preamble;
+
+    // Step 3: a clean preamble correlates perfectly across a few adjacent
+    // ticks, since the majority vote tolerates a window straddling a bit
+    // edge. Rather than locking onto the first tick that is close enough
+    // (which lands early in the bit), watch the correlation for a full bit
+    // period and lock onto the middle of the best run.
+    //
+    // A v2 sync word is half as long, so it is allowed half the errors. Once
+    // a candidate is found, the rest of the bit period is judged against
+    // whichever it was.
+    uint8_t distance;
+    if (state->lock_ticks == 0)
+    {
+        distance = __ask_preamble_distance(preamble);
+        state->lock_format = ASK_FRAME_V1;
+        if (distance > reader->params.preamble_max_errors)
+        {
+            if (!reader->params.accept_v2)
+            {
+                return;
+            }
+            distance = __ask_preamble_distance(preamble, ASK_FRAME_V2);
+            if (distance > reader->params.preamble_max_errors / 2)
+            {
+                return;
+            }
+            state->lock_format = ASK_FRAME_V2;
+        }
+
+        state->lock_best_distance = distance;
+        state->lock_best_start = 0;
+        state->lock_best_end = 0;
+    }
+    else if ((distance = __ask_preamble_distance(preamble, state->lock_format)) < state->lock_best_distance)
+    {
+        state->lock_best_distance = distance;
+        state->lock_best_start = state->lock_ticks;
+        state->lock_best_end = state->lock_ticks;
+    }
+    else if (distance == state->lock_best_distance &&
+        state->lock_best_end == state->lock_ticks - 1)
+    {
+        state->lock_best_end = state->lock_ticks;
+    }
+
+    state->lock_ticks++;
+    if (state->lock_ticks < DIV_PER_BIT)
+    {
+        return;
+    }
+
+    uint8_t lock_tick = (state->lock_best_start + state->lock_best_end) / 2;
+    state->lock_overrun = (DIV_PER_BIT - 1) - lock_tick;
+
+#if ASK_TRACE
+    hex_print_preamble_buffer(reader);
+#endif
+    // The sender computed the FCS over the true preamble, whatever bits of
+    // it may have been flipped on the way.
+    reader->frame.format = state->lock_format;
+    if (state->lock_format == ASK_FRAME_V2)
+    {
+        reader->frame.preamble = FRAME_SYNC_V2;
+        reader->fcs = __ask_fcs_update(ASK_FCS_INIT, (uint8_t*)&reader->frame.preamble, sizeof(uint16_t));
+    }
+    else
+    {
+        reader->frame.preamble = FRAME_PREAMBLE;
+    }
+    reader->stage = PREAMBLE_SCAN_COMPLETE;
+}
+
+// Repair and strip the FEC from a frame's payload in place, leaving fcs_ok
+// set from the repaired frame. Returns false if it was beyond repair.
+bool __ask_fec_decode_frame(struct ask_reader* reader, struct ask_frame* frame)
 {
-    uint64_t output = 0;
+    struct ask_fec_params* fec = &reader->params.fec;
+    ask_len_t encoded_len = frame->payload_byte_count;
+    uint8_t* decoded = (uint8_t*)malloc(encoded_len + 1);
+    uint32_t corrected = 0;
+
+    ask_len_t datalen = (decoded == NULL ? -1 :
+        ask_fec_decode(fec, frame->data, encoded_len, frame->erasures, decoded, &corrected));
+    if (reader->params.pool == NULL)
+    {
+        free(frame->erasures);
+    }
+    frame->erasures = NULL;
+    if (datalen < 0)
+    {
+        free(decoded);
+        return false;
+    }
 
-    for (int i = 0 ; i < 8 * num_bytes ; i++)
+    // The FCS covers what was sent, so after a repair it is checked against
+    // the payload re-encoded, which also catches a miscorrection.
+    if (corrected > 0)
     {
-        output += ((uint64_t)(ONES_PER_BYTE[bytes[i]] >= 6) << i);
+        frame->fcs_ok = (ask_fec_encode(fec, decoded, datalen, frame->data) &&
+            __ask_fcs_calculate(frame) == frame->checksum);
     }
 
-    return output;
+    reader->stats.fec_corrected += corrected;
+    if (reader->params.pool != NULL)
+    {
+        // The payload goes back into the pool buffer it came in on.
+        memcpy(frame->data, decoded, datalen);
+        free(decoded);
+    }
+    else
+    {
+        free(frame->data);
+        frame->data = decoded;
+    }
+    frame->payload_byte_count = datalen;
+    return true;
 }
 
-void ask_read_preamble(struct ask_reader* reader, uint8_t pulse)
-{   
-    // hex_print_preamble_buffer(reader);
-    // Step 1: shuffle the preamble bit buffer left to make room at the
-    // LSB to put the new incoming pulse.
-    uint8_t overflow = pulse;
-    uint8_t incoming = pulse;
-    for (int i = 0 ; i < sizeof(preamble_t) ; i++)
+// Read a length from an aggregated frame's table at *offset, moving past it.
+// Returns -1 if it runs off the end of the frame or isn't a valid varint.
+ask_len_t __ask_aggregate_length(const uint8_t* data, ask_len_t datalen, ask_len_t* offset)
+{
+    if (*offset >= datalen)
     {
-        uint64_t v = reader->preamble_state.frame_preamble_pulses[i];
-        overflow = v >> 63;
-        v <<= 1;
-        v += incoming;
-        incoming = overflow;
-        reader->preamble_state.frame_preamble_pulses[i] = v;
+        return -1;
+    }
+    ask_len_t len = data[*offset] & 0x7f;
+    if (data[(*offset)++] & 0x80)
+    {
+        if (*offset >= datalen || (data[*offset] & 0x80))
+        {
+            return -1;
+        }
+        len |= data[(*offset)++] << 7;
     }
+    return len;
+}
 
-    reader->frame.preamble = __ask_pulses_to_bytes((uint8_t*)reader->preamble_state.frame_preamble_pulses, sizeof(preamble_t));
+// Hand each datagram of an aggregated frame to datagram_ready() in turn.
+// With a pool they are handed over in place, sharing the frame's buffer,
+// and otherwise each is copied out to its own allocation.
+void __ask_deliver_aggregate(struct ask_reader* reader, struct ask_frame* frame)
+{
+    const uint8_t* data = frame->data;
+    ask_len_t datalen = frame->payload_byte_count;
+
+    // Check the whole table adds up before handing anything over.
+    uint8_t count = data[0];
+    ask_len_t offset = 1;
+    ask_len_t total = 0;
+    for (uint8_t i = 0 ; i < count ; i++)
+    {
+        ask_len_t len = __ask_aggregate_length(data, datalen, &offset);
+        if (len <= 0)
+        {
+            total = -1;
+            break;
+        }
+        total += len;
+    }
+    if (count == 0 || total != datalen - offset)
+    {
+        reader->stats.aggregate_errors++;
+        __ask_reader_release(reader, frame->data);
+        return;
+    }
 
-    // TODO Check to see if adding another bit would improve the
-    // XOR autocorrelation with the target value. If so, delay
-    // moving to the next stage of processing.
-    //
-    // Notably, a perfect read will always need 3 more pulses
-    // to perfectly synchronize.
-    
-    if (reader->frame.preamble == FRAME_PREAMBLE)
+    struct ask_pool* pool = reader->params.pool;
+    if (pool != NULL)
     {
-        hex_print_preamble_buffer(reader);
-        reader->stage = PREAMBLE_SCAN_COMPLETE;
+        pool->refs[(frame->data - pool->memory) / pool->stride] = count;
+    }
+
+    ask_len_t table = 1;
+    for (uint8_t i = 0 ; i < count ; i++)
+    {
+        ask_len_t len = __ask_aggregate_length(data, datalen, &table);
+        if (len <= 0)
+        {
+            break;
+        }
+        if (pool != NULL)
+        {
+            reader->params.datagram_ready(frame->data + offset, len);
+        }
+        else
+        {
+            uint8_t* copy = (uint8_t*)malloc(len);
+            if (copy != NULL)
+            {
+                memcpy(copy, data + offset, len);
+                reader->params.datagram_ready(copy, len);
+            }
+        }
+        offset += len;
+    }
+
+    if (pool == NULL)
+    {
+        free(frame->data);
     }
 }
 
-void __ask_fcs_validate(struct ask_reader reader)
+void __ask_fcs_validate(struct ask_reader* reader, struct ask_frame* frame)
 {
-    checksum_t computed_fcs = __ask_fcs_calculate(&reader.frame);
-    if (computed_fcs == reader.frame.checksum)
+    if (frame->erasures != NULL && !__ask_fec_decode_frame(reader, frame))
+    {
+        reader->stats.fec_failures++;
+        __ask_reader_release(reader, frame->data);
+        return;
+    }
+
+    // The FCS was already checked by the reader as the frame came in.
+    if (frame->fcs_ok)
     {
-        reader.stage = FCS_CHECK_COMPLETE;
-        reader.stage = PACKET_OK;
-        reader.params.datagram_ready(reader.frame.data, reader.frame.payload_byte_count);
+        reader->stats.frames_ok++;
+        if (frame->flags & ASK_FLAG_AGGREGATE)
+        {
+            __ask_deliver_aggregate(reader, frame);
+        }
+        else
+        {
+            reader->params.datagram_ready(frame->data, frame->payload_byte_count);
+        }
     }
     else
     {
-        printf("FCS CHECK FAILURE %u %u\n", computed_fcs, reader.frame.checksum);
-        reader.stage = FCS_CHECK_ERROR;
-        reader.stage = PACKET_ERROR;
+#if ASK_TRACE
+        fprintf(stderr, "FCS CHECK FAILURE %u\n", frame->checksum);
+#endif
+        reader->stats.fcs_errors++;
+        // The payload is only handed over to datagram_ready on success.
+        __ask_reader_release(reader, frame->data);
     }
 }
 
-void ask_reader_callback(struct ask_reader* reader)
+// Hand a fully read frame over to the consumer, or drop it if the
+// completion queue is full. Called from the reader callback.
+void __ask_rx_complete(struct ask_reader* reader)
 {
-    // The idea here is to watch for a preamble by:
-    // - Reading in pulses into a pulse buffer equal to sizeof(preamble) bytes long FIFO
-    //  > For every bit we read, shuffle everything over 1 pulse
-    // - On each pulse, attempt to synchronize by seeing if there's a preamble in the
-    //   pulse buffer
-    // - On successful detection of a preamble, mark a datagram as incoming, and
-    //   begin reading in the data length, data, and checksum.
-    // - If a nonsense symbol (e.g., 6 bits that doesn't decode to a valid nybble)
-    //   is detected, throw away the remaining pulses entirely (ignore them).
-    // - Otherwise, 
-    // - And then 
+    reader->stats.frames_received = reader->stats.frames_received + 1;
 
-    // Read a pulse
-    uint8_t pulse = reader->params.read();
-    
+    if (reader->completed_head - reader->completed_tail == ASK_RX_QUEUE_DEPTH)
+    {
+        reader->stats.frames_dropped = reader->stats.frames_dropped + 1;
+        __ask_reader_discard(reader, &reader->frame);
+        return;
+    }
+
+    // The pool buffer goes with the frame, and the next frame loans another.
+    reader->pool_buffer = NULL;
+    reader->completed[reader->completed_head % ASK_RX_QUEUE_DEPTH] = reader->frame;
+    std::atomic_thread_fence(std::memory_order_release);
+    reader->completed_head = reader->completed_head + 1;
+}
+
+// Validate and deliver every frame the reader has completed, returning how
+// many were handled. This is meant to be called from a single long-lived
+// consumer (a main loop, or a low-rate Repeater), never from the timer.
+uint32_t ask_reader_process(struct ask_reader* reader)
+{
+    uint32_t handled = 0;
+
+    while (reader->completed_tail != reader->completed_head)
+    {
+        // Pairs with the release in __ask_rx_complete().
+        std::atomic_thread_fence(std::memory_order_acquire);
+        struct ask_frame frame = reader->completed[reader->completed_tail % ASK_RX_QUEUE_DEPTH];
+        std::atomic_thread_fence(std::memory_order_release);
+        reader->completed_tail = reader->completed_tail + 1;
+
+        __ask_fcs_validate(reader, &frame);
+        handled++;
+    }
+
+    return handled;
+}
+
+// Feed one division's worth of line level to the reader, however it was
+// sampled.
+void __ask_reader_pulse(struct ask_reader* reader, uint8_t pulse)
+{
     // Reading the preamble is different from reading a symbol, as
     // during the preamble scan, we do not yet have a synchronzied
     // clock with the sender. This requires storing every pulse for the
@@ -521,10 +2156,30 @@ void ask_reader_callback(struct ask_reader* reader)
 
         if (reader->stage == PREAMBLE_SCAN_COMPLETE)
         {
-            reader->symbol_state.num_symbols = 2 * sizeof(ask_len_t);
-            reader->symbol_state.output = (uint8_t*)&reader->frame.payload_byte_count;
-            __ask_symbol_state_reset(&reader->symbol_state);
-            reader->stage = PAYLOAD_LENGTH_READ;
+            // A v2 header is read a byte at a time, until it says how long
+            // it is.
+            if (reader->frame.format == ASK_FRAME_V2)
+            {
+                reader->symbol_state.num_symbols = 2;
+                reader->symbol_state.output = &reader->frame.header[0];
+                reader->stage = HEADER_READ;
+            }
+            else
+            {
+                reader->symbol_state.num_symbols = 2 * sizeof(ask_len_t);
+                reader->symbol_state.output = (uint8_t*)&reader->frame.payload_byte_count;
+                reader->stage = PAYLOAD_LENGTH_READ;
+            }
+            __ask_symbol_state_sync(&reader->symbol_state,
+                (reader->preamble_state.pulse_window >> reader->preamble_state.lock_overrun) & 1,
+                reader->params.encoding);
+
+            // Replay the pulses consumed while searching for the best
+            // alignment, which are the start of the length field or header.
+            for (int i = reader->preamble_state.lock_overrun - 1 ; i >= 0 ; i--)
+            {
+                ask_read_symbols(reader, (reader->preamble_state.pulse_window >> i) & 1);
+            }
         }
     }
     // Once the preamble scan is complete, we can move onto synchronized
@@ -535,13 +2190,289 @@ void ask_reader_callback(struct ask_reader* reader)
     }
     else if (reader->stage == FCS_READ_COMPLETE)
     {
-        printf("FCS_READ Complete, detaching validation and callback task\n");
-        std::thread* t = new std::thread(__ask_fcs_validate, *reader);
-        t->detach();
+        __ask_rx_complete(reader);
         
         // Return the reader back to preamble scanning.
-        *reader = ask_reader_init(reader->params);
+        __ask_reader_reset(reader);
+    }
+}
+
+// Whether the preamble scan has seen nothing but level for at least a full
+// preamble, in which case more of the same leaves it unchanged.
+bool __ask_preamble_settled(struct ask_preamble_read_state* state, uint8_t level)
+{
+    if (state->lock_ticks != 0 || state->pulse_window_ones != (level ? DIV_PER_BIT : 0))
+    {
+        return false;
+    }
+
+    preamble_t settled = (level ? ~(preamble_t)0 : 0);
+    for (int i = 0 ; i < DIV_PER_BIT ; i++)
+    {
+        if (state->phase_preambles[i] != settled)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Feed a run of divs pulses at one level to the reader.
+void __ask_reader_run(struct ask_reader* reader, uint8_t level, uint32_t divs)
+{
+    for (uint32_t i = 0 ; i < divs ; i++)
+    {
+        // On an idle line, the rest of a run is skipped once the preamble
+        // scan has stopped changing. The phase the scan is left at doesn't
+        // matter, since every phase has seen the same pulses.
+        if ((i == 0 || i == ASK_EDGE_MAX_RUN_DIVS) && reader->stage == PREAMBLE_SCAN &&
+            __ask_preamble_settled(&reader->preamble_state, level))
+        {
+            break;
+        }
+
+        __ask_reader_pulse(reader, level);
+    }
+
+    // A finished frame would otherwise wait for the next pulse to be handed
+    // off, and the next pulse may be a long way away.
+    if (reader->stage == FCS_READ_COMPLETE)
+    {
+        __ask_reader_pulse(reader, level);
+    }
+}
+
+// Whether the last runs of the line, the newest at level, are pattern's.
+// If so, leaves the division period they give in the rate state.
+bool __ask_rate_match(struct ask_reader* reader, const struct ask_rate_pattern* pattern, uint8_t level)
+{
+    struct ask_rate_state* rate = &reader->rate_state;
+    if (rate->num_runs < pattern->num_runs || level != pattern->last_level)
+    {
+        return false;
+    }
+
+    uint64_t total_us = 0;
+    for (uint8_t i = 0 ; i < pattern->num_runs ; i++)
+    {
+        total_us += rate->run_us[(uint8_t)(rate->run_head - 1 - i) % ASK_RATE_MAX_RUNS];
+    }
+    uint64_t bit_ns = total_us * 1000 / pattern->total_bits;
+    uint64_t div_ns = bit_ns / DIV_PER_BIT;
+
+    // An eighth either side of the limits, for the sender's clock being off.
+    if (div_ns * 8 < (uint64_t)reader->params.us_per_div * 7000 ||
+        div_ns * 8 > (uint64_t)reader->params.max_us_per_div * 9000)
+    {
+        return false;
+    }
+
+    for (uint8_t i = 0 ; i < pattern->num_runs ; i++)
+    {
+        uint64_t run_ns = (uint64_t)rate->run_us[(uint8_t)(rate->run_head - pattern->num_runs + i) % ASK_RATE_MAX_RUNS] * 1000;
+        uint64_t expected_ns = pattern->run_bits[i] * bit_ns;
+        uint64_t error_ns = (run_ns > expected_ns ? run_ns - expected_ns : expected_ns - run_ns);
+        if (error_ns * 3 > bit_ns)
+        {
+            return false;
+        }
     }
+
+    rate->div_ns = div_ns;
+    return true;
+}
+
+// Start reading the frame whose preamble matched pattern, at the rate found,
+// by replaying the preamble to the preamble scan up to its last run, which
+// has only just begun.
+void __ask_rate_lock(struct ask_reader* reader, const struct ask_rate_pattern* pattern)
+{
+#if ASK_TRACE
+    fprintf(stderr, "RATE %uns per division\n", reader->rate_state.div_ns);
+#endif
+    reader->stats.rate_detections = reader->stats.rate_detections + 1;
+    reader->rate_state.num_runs = 0;
+    reader->rate_state.merging = false;
+    reader->rate_state.pulses = 0;
+
+    __ask_reader_reset(reader);
+    for (uint8_t i = 0 ; i < pattern->replay_bits ; i++)
+    {
+        uint8_t bit = (pattern->word >> (pattern->num_bits - 1 - i)) & 1;
+        for (int d = 0 ; d < DIV_PER_BIT ; d++)
+        {
+            __ask_reader_pulse(reader, bit);
+        }
+    }
+}
+
+// Feed a run of divs pulses of the frame being read at the detected rate,
+// and go back to matching runs once it is done, or if its preamble didn't
+// lock after all.
+void __ask_rate_feed(struct ask_reader* reader, uint8_t level, uint32_t divs)
+{
+    struct ask_rate_state* rate = &reader->rate_state;
+
+    __ask_reader_run(reader, level, divs);
+    if (rate->pulses < ASK_RATE_LOCK_DIVS)
+    {
+        rate->pulses += (divs < ASK_RATE_LOCK_DIVS ? divs : ASK_RATE_LOCK_DIVS);
+    }
+    if (reader->stage == PREAMBLE_SCAN && rate->pulses >= ASK_RATE_LOCK_DIVS)
+    {
+        rate->div_ns = 0;
+    }
+}
+
+// A run of the line at level, elapsed_us long, when detecting the rate.
+void __ask_rate_run(struct ask_reader* reader, uint8_t level, uint32_t elapsed_us)
+{
+    struct ask_rate_state* rate = &reader->rate_state;
+
+    if (rate->div_ns != 0)
+    {
+        uint32_t divs = ((uint64_t)elapsed_us * 1000 + rate->div_ns / 2) / rate->div_ns;
+        __ask_rate_feed(reader, level, divs);
+        return;
+    }
+
+    uint32_t* last_us = &rate->run_us[(uint8_t)(rate->run_head - 1) % ASK_RATE_MAX_RUNS];
+    if (rate->merging)
+    {
+        *last_us += elapsed_us;
+        rate->merging = false;
+    }
+    else if (rate->num_runs > 0 && elapsed_us < reader->params.us_per_div * DIV_PER_BIT / 2)
+    {
+        *last_us += elapsed_us;
+        rate->merging = true;
+        return;
+    }
+    else
+    {
+        rate->run_us[rate->run_head++ % ASK_RATE_MAX_RUNS] = elapsed_us;
+        if (rate->num_runs < ASK_RATE_MAX_RUNS)
+        {
+            rate->num_runs++;
+        }
+    }
+
+    for (const struct ask_rate_pattern& pattern : ASK_RATE_PATTERNS)
+    {
+        if ((pattern.format == ASK_FRAME_V1 || reader->params.accept_v2) &&
+            __ask_rate_match(reader, &pattern, level))
+        {
+            __ask_rate_lock(reader, &pattern);
+            return;
+        }
+    }
+}
+
+// The edge-driven alternative to polling ask_reader_callback() every
+// division, for use from a GPIO edge interrupt. level is the level the line
+// has just changed to, and timestamp_us the time of the change on any free
+// running microsecond clock (wrapping is fine).
+//
+// The run of pulses at the previous level is rebuilt from the time since the
+// last edge, rounded to the nearest division, so the cost is proportional
+// to the signal rather than to the time spent listening.
+void ask_reader_edge(struct ask_reader* reader, uint8_t level, uint32_t timestamp_us)
+{
+    struct ask_edge_state* state = &reader->edge_state;
+
+    if (state->started)
+    {
+        uint32_t elapsed_us = timestamp_us - state->last_us;
+        if (reader->params.max_us_per_div != 0)
+        {
+            // Runs are matched whole, so the same level again just carries
+            // the run on.
+            if (level == state->level)
+            {
+                return;
+            }
+            __ask_rate_run(reader, state->level, elapsed_us);
+        }
+        else
+        {
+            uint32_t divs = (elapsed_us + reader->params.us_per_div / 2) / reader->params.us_per_div;
+            __ask_reader_run(reader, state->level, divs);
+        }
+    }
+
+    state->started = true;
+    state->level = level;
+    state->last_us = timestamp_us;
+}
+
+// The last run before the line goes quiet has no edge to end it, so the
+// final bits of a frame would not be decoded until the next transmission.
+// Calling this now and then (every few milliseconds is plenty) decodes the
+// whole divisions seen at the current level so far.
+void ask_reader_edge_poll(struct ask_reader* reader, uint32_t timestamp_us)
+{
+    struct ask_edge_state* state = &reader->edge_state;
+
+    if (!state->started)
+    {
+        return;
+    }
+
+    // While matching runs, there is nothing to do until the run ends.
+    if (reader->params.max_us_per_div != 0)
+    {
+        uint32_t div_ns = reader->rate_state.div_ns;
+        if (div_ns == 0)
+        {
+            return;
+        }
+        uint32_t divs = (uint64_t)(timestamp_us - state->last_us) * 1000 / div_ns;
+        state->last_us += (uint64_t)divs * div_ns / 1000;
+        __ask_rate_feed(reader, state->level, divs);
+        return;
+    }
+
+    uint32_t divs = (timestamp_us - state->last_us) / reader->params.us_per_div;
+    __ask_reader_run(reader, state->level, divs);
+    state->last_us += divs * reader->params.us_per_div;
+}
+
+void ask_reader_callback(struct ask_reader* reader)
+{
+    // The idea here is to watch for a preamble by:
+    // - Reading in pulses into a pulse buffer equal to sizeof(preamble) bytes long FIFO
+    //  > For every bit we read, shuffle everything over 1 pulse
+    // - On each pulse, attempt to synchronize by seeing if there's a preamble in the
+    //   pulse buffer
+    // - On successful detection of a preamble, mark a datagram as incoming, and
+    //   begin reading in the data length, data, and checksum.
+    // - If a nonsense symbol (e.g., 6 bits that doesn't decode to a valid nybble)
+    //   is detected, throw away the remaining pulses entirely (ignore them).
+    // - Otherwise, 
+    // - And then 
+
+    // Read a pulse
+    uint8_t pulse = reader->params.read();
+
+    // When detecting the rate, the pulses are samples us_per_div apart, and
+    // each change of level is handled as an edge.
+    if (reader->params.max_us_per_div != 0)
+    {
+        struct ask_edge_state* state = &reader->edge_state;
+        reader->rate_state.sample_us += reader->params.us_per_div;
+        if (!state->started || pulse != state->level)
+        {
+            ask_reader_edge(reader, pulse, reader->rate_state.sample_us);
+        }
+        else
+        {
+            ask_reader_edge_poll(reader, reader->rate_state.sample_us);
+        }
+        return;
+    }
+
+    __ask_reader_pulse(reader, pulse);
 }
 
 #endif
\ No newline at end of file
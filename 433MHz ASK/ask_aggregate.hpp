@@ -0,0 +1,268 @@
+#ifndef ASK_AGGREGATE_HPP
+#define ASK_AGGREGATE_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ask.hpp"
+
+// Packing several small records into one frame, so that a burst of them
+// pays for one sync word, header, FCS and inter-frame gap between them,
+// rather than one each.
+//
+// Records are copied into the frame being filled, which is sent when it
+// holds max_records, or the next record wouldn't fit in max_bytes, or its
+// first record has waited max_delay_us. The bigger the frames are allowed
+// to get, and the longer a record may wait for others to join it, the less
+// airtime goes on overhead, at the cost of latency.
+//
+// An aggregated frame is a v2 frame with ASK_FLAG_AGGREGATE set, so the
+// writer must send v2 frames, and the reader must take them. The reader
+// splits the frame back up and hands each record to datagram_ready() on
+// its own, so the application sees exactly the records that were written.
+// A frame that only ends up holding one record is sent as an ordinary one.
+//
+// Like the writer, an aggregator has a single producer, and nothing else
+// may write to its writer.
+
+#define ASK_AGGREGATE_MAX_RECORDS 32
+// The count byte, then up to two bytes of length for each record.
+#define ASK_AGGREGATE_MAX_TABLE (1 + 2 * ASK_AGGREGATE_MAX_RECORDS)
+// A frame's records are read in place while it is sent, so there is a
+// buffer for each frame the writer can have queued, and one to fill. A
+// buffer is only reused once the writer has published as many frames after
+// it as its queue holds, by which time it must have been sent.
+#define ASK_AGGREGATE_BUFFERS (ASK_TX_QUEUE_DEPTH + 1)
+
+struct ask_aggregator_params {
+    // At most ASK_AGGREGATE_MAX_RECORDS. 1 turns aggregation off.
+    uint8_t max_records;
+    // The longest payload, length table included. With FEC, it must still
+    // fit a v2 frame once encoded.
+    ask_len_t max_bytes;
+    // The longest a record waits for others, checked by ask_aggregator_poll().
+    uint32_t max_delay_us;
+};
+
+struct ask_aggregate_buffer {
+    // The count byte, then the length of each record.
+    uint8_t table[ASK_AGGREGATE_MAX_TABLE];
+    ask_len_t table_len;
+    uint8_t* data;
+    ask_len_t data_len;
+    uint8_t num_records;
+    // When the first record was added.
+    uint32_t first_us;
+};
+
+struct ask_aggregator_stats {
+    uint32_t records;
+    uint32_t frames;
+    // Frames sent because they were full, and because a record had waited
+    // max_delay_us.
+    uint32_t flushes_full;
+    uint32_t flushes_delay;
+    // Records turned away because the writer's queue was full.
+    uint32_t queue_full;
+};
+
+struct ask_aggregator {
+    struct ask_aggregator_params params;
+    struct ask_writer* writer;
+    struct ask_aggregate_buffer buffers[ASK_AGGREGATE_BUFFERS];
+    uint8_t current;
+    struct ask_aggregator_stats stats;
+};
+
+inline void __ask_aggregate_reset(struct ask_aggregate_buffer* buffer)
+{
+    buffer->table_len = 1;
+    buffer->data_len = 0;
+    buffer->num_records = 0;
+    buffer->first_us = 0;
+}
+
+// Free the buffers, once the writer has sent everything. Safe to call
+// after ask_aggregator_init() has failed.
+void ask_aggregator_free(struct ask_aggregator* aggregator)
+{
+    for (int i = 0 ; i < ASK_AGGREGATE_BUFFERS ; i++)
+    {
+        free(aggregator->buffers[i].data);
+        aggregator->buffers[i].data = NULL;
+    }
+}
+
+// Start aggregating records to writer. Returns false, with the reason on
+// stderr, if the parameters can't work with it or there isn't the memory.
+bool ask_aggregator_init(struct ask_aggregator* aggregator, struct ask_writer* writer, struct ask_aggregator_params params)
+{
+    aggregator->params = params;
+    aggregator->writer = writer;
+    aggregator->current = 0;
+    aggregator->stats = {0,0,0,0,0};
+    for (int i = 0 ; i < ASK_AGGREGATE_BUFFERS ; i++)
+    {
+        aggregator->buffers[i].data = NULL;
+    }
+
+    if (writer->params.format != ASK_FRAME_V2)
+    {
+        fprintf(stderr, "Aggregation needs a writer sending v2 frames\n");
+        return false;
+    }
+    if (params.max_records == 0 || params.max_records > ASK_AGGREGATE_MAX_RECORDS)
+    {
+        fprintf(stderr, "Aggregation of %u records is not 1 to %u\n", params.max_records, ASK_AGGREGATE_MAX_RECORDS);
+        return false;
+    }
+    ask_len_t onair_bytes = (ask_fec_enabled(&writer->params.fec) ?
+        ask_fec_encoded_len(&writer->params.fec, params.max_bytes) : params.max_bytes);
+    if (params.max_bytes < 4 || onair_bytes < 0 || onair_bytes > ASK_V2_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "Aggregated frames of %d bytes don't fit a v2 frame\n", params.max_bytes);
+        return false;
+    }
+
+    for (int i = 0 ; i < ASK_AGGREGATE_BUFFERS ; i++)
+    {
+        aggregator->buffers[i].data = (uint8_t*)malloc(params.max_bytes);
+        if (aggregator->buffers[i].data == NULL)
+        {
+            fprintf(stderr, "Unable to allocate %d aggregation buffers of %d bytes\n",
+                ASK_AGGREGATE_BUFFERS, params.max_bytes);
+            ask_aggregator_free(aggregator);
+            return false;
+        }
+        __ask_aggregate_reset(&aggregator->buffers[i]);
+    }
+    return true;
+}
+
+// Queue the records waiting so far as one frame, without waiting for it to
+// be sent. Returns the number of records queued, or -1 if the writer's
+// queue is full, in which case they stay waiting.
+int32_t ask_aggregator_flush(struct ask_aggregator* aggregator)
+{
+    struct ask_aggregate_buffer* buffer = &aggregator->buffers[aggregator->current];
+    if (buffer->num_records == 0)
+    {
+        return 0;
+    }
+
+    int32_t result;
+    if (buffer->num_records == 1)
+    {
+        struct ask_iovec iov = {buffer->data, buffer->data_len};
+        result = ask_write_iov(aggregator->writer, &iov, 1, true);
+    }
+    else
+    {
+        buffer->table[0] = buffer->num_records;
+        struct ask_iovec iov[2] = {{buffer->table, buffer->table_len}, {buffer->data, buffer->data_len}};
+        result = ask_write_iov(aggregator->writer, iov, 2, true, ASK_FLAG_AGGREGATE);
+    }
+    if (result < 0)
+    {
+        return -1;
+    }
+
+    int32_t num_records = buffer->num_records;
+    aggregator->stats.frames++;
+    aggregator->current = (aggregator->current + 1) % ASK_AGGREGATE_BUFFERS;
+    __ask_aggregate_reset(&aggregator->buffers[aggregator->current]);
+    return num_records;
+}
+
+// Add a record to the frame being filled, copying it, and send the frame if
+// that fills it. now_us is the time on any clock that counts microseconds,
+// as long as ask_aggregator_poll() is given the same one. Returns datalen,
+// or -1 if the record is longer than a frame can hold, or the frame before
+// it had to be sent to make room and the writer's queue was full.
+int32_t ask_aggregate_write(struct ask_aggregator* aggregator, uint8_t* data, ask_len_t datalen, uint32_t now_us)
+{
+    uint8_t length_bytes = (datalen > 0x7f ? 2 : 1);
+    if (datalen <= 0 || 1 + length_bytes + datalen > aggregator->params.max_bytes)
+    {
+        return -1;
+    }
+
+    struct ask_aggregate_buffer* buffer = &aggregator->buffers[aggregator->current];
+    if (buffer->num_records == aggregator->params.max_records ||
+        buffer->table_len + length_bytes + buffer->data_len + datalen > aggregator->params.max_bytes)
+    {
+        if (ask_aggregator_flush(aggregator) < 0)
+        {
+            aggregator->stats.queue_full++;
+            return -1;
+        }
+        aggregator->stats.flushes_full++;
+        buffer = &aggregator->buffers[aggregator->current];
+    }
+
+    if (buffer->num_records == 0)
+    {
+        buffer->first_us = now_us;
+    }
+    if (length_bytes == 2)
+    {
+        buffer->table[buffer->table_len++] = (datalen & 0x7f) | 0x80;
+        buffer->table[buffer->table_len++] = datalen >> 7;
+    }
+    else
+    {
+        buffer->table[buffer->table_len++] = datalen;
+    }
+    memcpy(buffer->data + buffer->data_len, data, datalen);
+    buffer->data_len += datalen;
+    buffer->num_records++;
+    aggregator->stats.records++;
+
+    // A full frame that can't be queued yet goes at the next poll.
+    if (buffer->num_records == aggregator->params.max_records ||
+        buffer->table_len + buffer->data_len + 2 > aggregator->params.max_bytes)
+    {
+        if (ask_aggregator_flush(aggregator) > 0)
+        {
+            aggregator->stats.flushes_full++;
+        }
+    }
+    return datalen;
+}
+
+// Send the frame being filled if its first record has waited max_delay_us,
+// or it is full and couldn't be sent before. Call this regularly, from the
+// same thread as ask_aggregate_write(). Returns as ask_aggregator_flush().
+int32_t ask_aggregator_poll(struct ask_aggregator* aggregator, uint32_t now_us)
+{
+    struct ask_aggregate_buffer* buffer = &aggregator->buffers[aggregator->current];
+    if (buffer->num_records == 0)
+    {
+        return 0;
+    }
+
+    bool full = (buffer->num_records == aggregator->params.max_records ||
+        buffer->table_len + buffer->data_len + 2 > aggregator->params.max_bytes);
+    if (!full && now_us - buffer->first_us < aggregator->params.max_delay_us)
+    {
+        return 0;
+    }
+
+    int32_t result = ask_aggregator_flush(aggregator);
+    if (result > 0)
+    {
+        if (full)
+        {
+            aggregator->stats.flushes_full++;
+        }
+        else
+        {
+            aggregator->stats.flushes_delay++;
+        }
+    }
+    return result;
+}
+
+#endif
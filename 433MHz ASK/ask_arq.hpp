@@ -0,0 +1,485 @@
+#ifndef ASK_ARQ_HPP
+#define ASK_ARQ_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ask.hpp"
+
+// Reliable, in-order delivery over a pair of links, one each way, by
+// selective-repeat ARQ.
+//
+// Each end has a writer to the other end's reader, and an ask_arq on top.
+// Data goes out as segments, each numbered, and up to window of them may be
+// unacknowledged at once. The receiving end answers with an ACK giving the
+// next segment it needs (everything before it has arrived) and a bitmap of
+// the ones after that it already holds, so only the segments actually lost
+// are sent again. Those received out of order are held until the gap is
+// filled, and delivered in order.
+//
+// A segment is sent again as soon as an ACK shows a segment sent after it
+// has arrived, as frames can't overtake each other on the air, or after a
+// timeout if nothing has been heard of it. The timeout follows the round
+// trip time measured from the ACKs (as in RFC 6298), and doubles each time
+// it expires without any progress.
+//
+// A segment is a frame payload of:
+// - ASK_ARQ_DATA, the 16-bit sequence number, then the data.
+// - ASK_ARQ_ACK, the 16-bit number of the next segment needed, then a 32-bit
+//   bitmap of the segments after it already received, the LSB first.
+// all little-endian.
+//
+// The reader's datagram_ready() passes what it receives to ask_arq_receive(),
+// and ask_arq_poll() must be called regularly, from the same thread. Time is
+// in microseconds, on any clock, as long as it is the same one throughout.
+
+#define ASK_ARQ_DATA 0xa1
+#define ASK_ARQ_ACK 0xa2
+#define ASK_ARQ_DATA_HEADER 3
+#define ASK_ARQ_ACK_BYTES 7
+
+// The most segments handed to the writer at once. The rest wait here, so a
+// segment sent again goes out next rather than behind every new one, and
+// the round trip measured is mostly time on air.
+#define ASK_ARQ_MAX_QUEUED 2
+
+// The largest window, no more than the ACK bitmap can cover.
+#define ASK_ARQ_MAX_WINDOW 32
+
+struct ask_arq_params {
+    // Segments unacknowledged at once, a power of two up to
+    // ASK_ARQ_MAX_WINDOW, so that sequence numbers wrap around to the same
+    // slot. Both ends must agree. 1 is stop-and-wait.
+    uint8_t window;
+    // The largest segment, not counting its header.
+    ask_len_t mtu;
+    // The timeout until the first round trip is measured, and its limits.
+    uint32_t initial_rto_us;
+    uint32_t min_rto_us;
+    uint32_t max_rto_us;
+    // Called with each segment received, once and in order. data is only
+    // valid during the call.
+    void(*deliver)(uint8_t* data, ask_len_t datalen);
+};
+
+// A segment sent, kept until it is acknowledged.
+struct ask_arq_segment {
+    // The header, then the data, sent in place by the writer.
+    uint8_t* frame;
+    ask_len_t len;
+    bool acked;
+    // Sent again at the next chance, as it is known or thought to be lost.
+    bool resend;
+    uint8_t transmissions;
+    uint32_t sent_us;
+    // The order in which it was last sent, among every segment.
+    uint32_t sent_order;
+    // The writer's sequence for the frame it was last sent in, and whether
+    // there is one, as the slot can't be reused until that frame is sent.
+    uint32_t writer_sequence;
+    bool on_writer;
+};
+
+// A segment received out of order, waiting for those before it.
+struct ask_arq_held {
+    uint8_t* data;
+    ask_len_t len;
+    bool present;
+};
+
+struct ask_arq_stats {
+    uint32_t segments_sent;
+    uint32_t retransmits;
+    // Retransmits because of an ACK, and because of a timeout.
+    uint32_t fast_retransmits;
+    uint32_t timeouts;
+    uint32_t acks_sent;
+    uint32_t acks_received;
+    uint32_t delivered;
+    // Segments received that had already been, or were beyond the window.
+    uint32_t duplicates;
+};
+
+struct ask_arq {
+    struct ask_arq_params params;
+    struct ask_writer* writer;
+
+    // Sending: segments from send_base up to send_next are in flight.
+    struct ask_arq_segment segments[ASK_ARQ_MAX_WINDOW];
+    uint16_t send_base;
+    uint16_t send_next;
+    uint32_t sent_order;
+    bool rtt_measured;
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t rto_us;
+
+    // Receiving: recv_next is the next segment to deliver.
+    struct ask_arq_held held[ASK_ARQ_MAX_WINDOW];
+    uint16_t recv_next;
+    bool ack_pending;
+    uint8_t ack[ASK_ARQ_ACK_BYTES];
+    uint32_t ack_writer_sequence;
+    bool ack_on_writer;
+
+    struct ask_arq_stats stats;
+};
+
+// Free the buffers, once the writer has sent everything. Safe to call
+// after ask_arq_init() has failed.
+void ask_arq_free(struct ask_arq* arq)
+{
+    for (int i = 0 ; i < ASK_ARQ_MAX_WINDOW ; i++)
+    {
+        free(arq->segments[i].frame);
+        free(arq->held[i].data);
+        arq->segments[i].frame = NULL;
+        arq->held[i].data = NULL;
+    }
+}
+
+// Start a reliable stream over writer. Returns false, with the reason on
+// stderr, if the parameters are out of range or there isn't the memory.
+bool ask_arq_init(struct ask_arq* arq, struct ask_writer* writer, struct ask_arq_params params)
+{
+    arq->params = params;
+    arq->writer = writer;
+    arq->send_base = 0;
+    arq->send_next = 0;
+    arq->sent_order = 0;
+    arq->rtt_measured = false;
+    arq->srtt_us = 0;
+    arq->rttvar_us = 0;
+    arq->rto_us = params.initial_rto_us;
+    arq->recv_next = 0;
+    arq->ack_pending = false;
+    arq->ack_writer_sequence = 0;
+    arq->ack_on_writer = false;
+    arq->stats = {0,0,0,0,0,0,0,0};
+    for (int i = 0 ; i < ASK_ARQ_MAX_WINDOW ; i++)
+    {
+        arq->segments[i] = {NULL,0,false,false,0,0,0,0,false};
+        arq->held[i] = {NULL,0,false};
+    }
+
+    if (params.window == 0 || params.window > ASK_ARQ_MAX_WINDOW ||
+        (params.window & (params.window - 1)) != 0 || params.mtu <= 0)
+    {
+        fprintf(stderr, "ARQ window %u is not a power of two up to %u, or mtu %d is not positive\n",
+            params.window, ASK_ARQ_MAX_WINDOW, params.mtu);
+        return false;
+    }
+
+    // Only the window's worth of slots is ever used.
+    for (int i = 0 ; i < params.window ; i++)
+    {
+        arq->segments[i].frame = (uint8_t*)malloc(ASK_ARQ_DATA_HEADER + params.mtu);
+        arq->held[i].data = (uint8_t*)malloc(params.mtu);
+        if (arq->segments[i].frame == NULL || arq->held[i].data == NULL)
+        {
+            fprintf(stderr, "Unable to allocate %u ARQ buffers of %d bytes\n", params.window, params.mtu);
+            ask_arq_free(arq);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether the writer may still be reading the frame it was given.
+inline bool __ask_arq_on_writer(struct ask_arq* arq, bool on_writer, uint32_t writer_sequence)
+{
+    return on_writer && (int32_t)(arq->writer->queue_tail - writer_sequence) <= 0;
+}
+
+// The number of segments in flight.
+inline uint16_t ask_arq_in_flight(struct ask_arq* arq)
+{
+    return arq->send_next - arq->send_base;
+}
+
+// Whether everything sent so far has been acknowledged.
+inline bool ask_arq_idle(struct ask_arq* arq)
+{
+    return arq->send_base == arq->send_next;
+}
+
+bool __ask_arq_transmit(struct ask_arq* arq, struct ask_arq_segment* segment, uint32_t now_us)
+{
+    if (ask_writer_queue_depth(arq->writer) >= ASK_ARQ_MAX_QUEUED)
+    {
+        return false;
+    }
+
+    uint32_t writer_sequence = arq->writer->queue_head;
+    struct ask_iovec iov = {segment->frame, segment->len};
+    if (ask_write_iov(arq->writer, &iov, 1, true) < 0)
+    {
+        return false;
+    }
+
+    segment->writer_sequence = writer_sequence;
+    segment->on_writer = true;
+    segment->sent_us = now_us;
+    segment->sent_order = arq->sent_order++;
+    segment->resend = false;
+    if (segment->transmissions < 0xff)
+    {
+        segment->transmissions++;
+    }
+    arq->stats.segments_sent++;
+    if (segment->transmissions > 1)
+    {
+        arq->stats.retransmits++;
+    }
+    return true;
+}
+
+// Send datalen bytes as the next segment. Returns datalen, or -1 if it is
+// longer than the mtu, or the window is full.
+int32_t ask_arq_send(struct ask_arq* arq, uint8_t* data, ask_len_t datalen, uint32_t now_us)
+{
+    if (datalen <= 0 || datalen > arq->params.mtu || ask_arq_in_flight(arq) >= arq->params.window)
+    {
+        return -1;
+    }
+
+    struct ask_arq_segment* segment = &arq->segments[arq->send_next % arq->params.window];
+    if (__ask_arq_on_writer(arq, segment->on_writer, segment->writer_sequence))
+    {
+        return -1;
+    }
+
+    segment->frame[0] = ASK_ARQ_DATA;
+    segment->frame[1] = arq->send_next & 0xff;
+    segment->frame[2] = arq->send_next >> 8;
+    memcpy(segment->frame + ASK_ARQ_DATA_HEADER, data, datalen);
+    segment->len = ASK_ARQ_DATA_HEADER + datalen;
+    segment->acked = false;
+    segment->transmissions = 0;
+    segment->on_writer = false;
+    arq->send_next++;
+
+    // If the writer is full, it goes at the next poll.
+    segment->resend = !__ask_arq_transmit(arq, segment, now_us);
+    return datalen;
+}
+
+void __ask_arq_rtt_sample(struct ask_arq* arq, uint32_t rtt_us)
+{
+    if (!arq->rtt_measured)
+    {
+        arq->srtt_us = rtt_us;
+        arq->rttvar_us = rtt_us / 2;
+        arq->rtt_measured = true;
+    }
+    else
+    {
+        uint32_t error = (arq->srtt_us > rtt_us ? arq->srtt_us - rtt_us : rtt_us - arq->srtt_us);
+        arq->rttvar_us = (3 * arq->rttvar_us + error) / 4;
+        arq->srtt_us = (7 * arq->srtt_us + rtt_us) / 8;
+    }
+
+    uint32_t rto_us = arq->srtt_us + 4 * arq->rttvar_us;
+    if (rto_us < arq->params.min_rto_us)
+    {
+        rto_us = arq->params.min_rto_us;
+    }
+    if (rto_us > arq->params.max_rto_us)
+    {
+        rto_us = arq->params.max_rto_us;
+    }
+    arq->rto_us = rto_us;
+}
+
+void __ask_arq_receive_ack(struct ask_arq* arq, uint16_t cumulative, uint32_t selective, uint32_t now_us)
+{
+    uint16_t in_flight = ask_arq_in_flight(arq);
+    // An ACK for segments not yet sent can only be from an earlier stream.
+    if ((uint16_t)(cumulative - arq->send_base) > in_flight)
+    {
+        return;
+    }
+
+    // The most recently sent of the segments this ACK is the first news of.
+    bool newly_acked = false;
+    uint32_t latest_order = 0;
+    for (uint16_t i = 0 ; i < in_flight ; i++)
+    {
+        uint16_t seq = arq->send_base + i;
+        uint16_t after = seq - cumulative - 1;
+        bool acked = ((int16_t)(seq - cumulative) < 0 || (after < 32 && ((selective >> after) & 1)));
+        struct ask_arq_segment* segment = &arq->segments[seq % arq->params.window];
+        if (!acked || segment->acked || segment->transmissions == 0)
+        {
+            continue;
+        }
+
+        segment->acked = true;
+        // Only a segment sent once says for sure which sending was answered.
+        if (segment->transmissions == 1)
+        {
+            __ask_arq_rtt_sample(arq, now_us - segment->sent_us);
+        }
+        if (!newly_acked || (int32_t)(segment->sent_order - latest_order) > 0)
+        {
+            latest_order = segment->sent_order;
+        }
+        newly_acked = true;
+    }
+
+    while (arq->send_base != arq->send_next && arq->segments[arq->send_base % arq->params.window].acked)
+    {
+        arq->send_base++;
+    }
+
+    // Anything still unacknowledged that was sent before a segment that has
+    // arrived must have been lost.
+    for (uint16_t seq = arq->send_base ; newly_acked && seq != arq->send_next ; seq++)
+    {
+        struct ask_arq_segment* segment = &arq->segments[seq % arq->params.window];
+        if (!segment->acked && !segment->resend && segment->transmissions > 0 &&
+            (int32_t)(latest_order - segment->sent_order) > 0)
+        {
+            segment->resend = true;
+            arq->stats.fast_retransmits++;
+        }
+    }
+}
+
+void __ask_arq_receive_data(struct ask_arq* arq, uint16_t seq, uint8_t* data, ask_len_t datalen)
+{
+    // Whatever it was, the sender needs to hear it arrived.
+    arq->ack_pending = true;
+
+    uint16_t offset = seq - arq->recv_next;
+    if (offset >= arq->params.window || datalen > arq->params.mtu)
+    {
+        arq->stats.duplicates++;
+        return;
+    }
+
+    struct ask_arq_held* held = &arq->held[seq % arq->params.window];
+    if (held->present)
+    {
+        arq->stats.duplicates++;
+        return;
+    }
+    memcpy(held->data, data, datalen);
+    held->len = datalen;
+    held->present = true;
+
+    for (held = &arq->held[arq->recv_next % arq->params.window] ; held->present ;
+        held = &arq->held[arq->recv_next % arq->params.window])
+    {
+        held->present = false;
+        arq->recv_next++;
+        arq->stats.delivered++;
+        arq->params.deliver(held->data, held->len);
+    }
+}
+
+// Take a datagram from the reader. Returns false if it isn't an ARQ
+// segment. The datagram still belongs to the caller afterwards.
+bool ask_arq_receive(struct ask_arq* arq, uint8_t* data, ask_len_t datalen, uint32_t now_us)
+{
+    if (data == NULL || datalen < 1)
+    {
+        return false;
+    }
+
+    if (data[0] == ASK_ARQ_DATA && datalen > ASK_ARQ_DATA_HEADER)
+    {
+        uint16_t seq = data[1] | (data[2] << 8);
+        __ask_arq_receive_data(arq, seq, data + ASK_ARQ_DATA_HEADER, datalen - ASK_ARQ_DATA_HEADER);
+        return true;
+    }
+    if (data[0] == ASK_ARQ_ACK && datalen == ASK_ARQ_ACK_BYTES)
+    {
+        uint16_t cumulative = data[1] | (data[2] << 8);
+        uint32_t selective = data[3] | (data[4] << 8) | (data[5] << 16) | ((uint32_t)data[6] << 24);
+        arq->stats.acks_received++;
+        __ask_arq_receive_ack(arq, cumulative, selective, now_us);
+        return true;
+    }
+    return false;
+}
+
+// Send an ACK if one is owed, and any segment that is due to be sent again,
+// or couldn't be sent before because the writer was full. Returns the
+// number of frames queued.
+uint32_t ask_arq_poll(struct ask_arq* arq, uint32_t now_us)
+{
+    uint32_t queued = 0;
+
+    // The ACK is sent in place, so it is only rebuilt once the writer has
+    // finished with the last one. It then covers everything since.
+    if (arq->ack_pending && !__ask_arq_on_writer(arq, arq->ack_on_writer, arq->ack_writer_sequence))
+    {
+        uint32_t selective = 0;
+        for (uint8_t i = 0 ; i + 1 < arq->params.window ; i++)
+        {
+            selective |= (uint32_t)arq->held[(uint16_t)(arq->recv_next + 1 + i) % arq->params.window].present << i;
+        }
+        arq->ack[0] = ASK_ARQ_ACK;
+        arq->ack[1] = arq->recv_next & 0xff;
+        arq->ack[2] = arq->recv_next >> 8;
+        arq->ack[3] = selective & 0xff;
+        arq->ack[4] = (selective >> 8) & 0xff;
+        arq->ack[5] = (selective >> 16) & 0xff;
+        arq->ack[6] = selective >> 24;
+
+        uint32_t writer_sequence = arq->writer->queue_head;
+        struct ask_iovec iov = {arq->ack, ASK_ARQ_ACK_BYTES};
+        if (ask_write_iov(arq->writer, &iov, 1, true) >= 0)
+        {
+            arq->ack_writer_sequence = writer_sequence;
+            arq->ack_on_writer = true;
+            arq->ack_pending = false;
+            arq->stats.acks_sent++;
+            queued++;
+        }
+    }
+
+    bool timed_out = false;
+    for (uint16_t seq = arq->send_base ; seq != arq->send_next ; seq++)
+    {
+        struct ask_arq_segment* segment = &arq->segments[seq % arq->params.window];
+        if (segment->acked)
+        {
+            continue;
+        }
+        bool expired = false;
+        if (!segment->resend)
+        {
+            if (now_us - segment->sent_us < arq->rto_us)
+            {
+                continue;
+            }
+            expired = true;
+        }
+        // A segment that has timed out but can't go out yet is left as it
+        // is, and only counted as a timeout once it is sent again, as it
+        // may be acknowledged in the meantime.
+        if (!__ask_arq_transmit(arq, segment, now_us))
+        {
+            break;
+        }
+        if (expired)
+        {
+            timed_out = true;
+            arq->stats.timeouts++;
+        }
+        queued++;
+    }
+
+    // Back off, in case the round trip has grown past the timeout.
+    if (timed_out)
+    {
+        arq->rto_us = (arq->rto_us > arq->params.max_rto_us / 2 ? arq->params.max_rto_us : 2 * arq->rto_us);
+    }
+    return queued;
+}
+
+#endif
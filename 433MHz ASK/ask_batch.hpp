@@ -0,0 +1,449 @@
+#ifndef ASK_BATCH_HPP
+#define ASK_BATCH_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "ask.hpp"
+
+// Offline decoding of a whole captured buffer of samples (one byte per
+// division, each 0 or 1, as the reader's read() would have returned them),
+// as fast as the host allows rather than one division per timer tick.
+//
+// Most of a capture is idle line or noise, so the preamble is first searched
+// for with a cheap prefilter over a bit-packed copy of the capture. Each bit
+// period is majority-voted with a single popcount, on two grids half a bit
+// apart so that one of them always sits well inside the bits, and the votes
+// are slid through a preamble-sized register. Only around a candidate is the
+// ordinary reader (the same preamble correlator, PLL and symbol decode as in
+// real time) run pulse by pulse, so what is decoded matches what a reader
+// polled over the same samples would have produced.
+//
+// Large captures are split between threads. Each thread owns the frames
+// whose preamble locks within its share of the capture, starts scanning a
+// preamble's length before it, and follows its last frame past the end.
+//
+// The prefilter only knows FRAME_PREAMBLE, so v2 frames are not decoded here.
+
+struct ask_batch_params {
+    uint8_t preamble_max_errors;
+    struct ask_fec_params fec;
+    // Zero uses one thread per core.
+    uint32_t threads;
+    // Called for each frame that passes its FCS, in capture order, from the
+    // calling thread. offset is the sample at which its preamble began.
+    // Takes ownership of data, which must be free()d.
+    void(*frame_ready)(size_t offset, uint8_t* data, ask_len_t datalen);
+    // The line code the frames were sent with.
+    enum ENCODING encoding;
+};
+
+struct ask_batch_stats {
+    // Places where the prefilter thought a preamble might be.
+    uint32_t candidates;
+    uint32_t frames_ok;
+    uint32_t fcs_errors;
+    uint32_t fec_corrected;
+    uint32_t fec_failures;
+};
+
+// The prefilter lets through anything within this many bits of the preamble
+// beyond preamble_max_errors, as its fixed grids can be up to a quarter of a
+// bit off from where the correlator will lock.
+#define ASK_BATCH_PREFILTER_SLACK 2
+
+#define ASK_BATCH_PREAMBLE_DIVS (8 * sizeof(preamble_t) * DIV_PER_BIT)
+
+// How far before a candidate the reader starts, so the correlator has seen
+// the whole preamble by the time it could lock, and how far past it the
+// reader carries on before deciding it was a false alarm.
+#define ASK_BATCH_LEAD_DIVS (ASK_BATCH_PREAMBLE_DIVS + 4 * DIV_PER_BIT)
+#define ASK_BATCH_TRAIL_DIVS (2 * DIV_PER_BIT)
+
+// Captures shorter than this per thread aren't worth splitting.
+#define ASK_BATCH_MIN_THREAD_DIVS (1 << 16)
+
+struct ask_batch_frame {
+    size_t offset;
+    // The sample after the frame's last, or where the reader gave up on it.
+    size_t end;
+    uint8_t* data;
+    ask_len_t datalen;
+};
+
+struct ask_batch_worker {
+    const uint64_t* bits;
+    size_t n;
+    // The range of samples in which this worker's preambles lock.
+    size_t begin;
+    size_t finish;
+    struct ask_reader reader;
+    // The one buffer the reader reads every frame into, each being copied
+    // out once it passes.
+    struct ask_pool pool;
+    std::vector<struct ask_batch_frame> frames;
+    uint32_t candidates;
+};
+
+void __ask_batch_ignore(uint8_t* data, ask_len_t datalen)
+{
+}
+
+// Pack samples 8 at a time into bits, the first sample in the LSB. Spreading
+// each byte's low bit to its own place in the top byte of the product, with
+// no two ever landing on the same bit, turns 8 samples into a byte with a
+// single multiply.
+void __ask_batch_pack(const uint8_t* samples, size_t n, uint64_t* bits)
+{
+    size_t i = 0;
+    for ( ; i + 8 <= n ; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, samples + i, sizeof(word));
+        uint64_t packed = ((word & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+        if (i % 64 == 0)
+        {
+            bits[i / 64] = 0;
+        }
+        bits[i / 64] |= packed << (i % 64);
+    }
+
+    for ( ; i < n ; i++)
+    {
+        if (i % 64 == 0)
+        {
+            bits[i / 64] = 0;
+        }
+        bits[i / 64] |= (uint64_t)(samples[i] & 1) << (i % 64);
+    }
+}
+
+inline uint8_t __ask_batch_sample(const uint64_t* bits, size_t i)
+{
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+// The number of high samples in [start, start + DIV_PER_BIT), from a single
+// unaligned load. The packed buffer has a spare word on the end for this.
+inline uint8_t __ask_batch_window_ones(const uint64_t* bits, size_t start)
+{
+    uint64_t window;
+    memcpy(&window, (const uint8_t*)bits + start / 8, sizeof(window));
+    window = (window >> (start % 8)) & ((1ULL << DIV_PER_BIT) - 1);
+#if DIV_PER_BIT <= 8
+    return ONES_PER_BYTE[window];
+#else
+    return __builtin_popcountll(window);
+#endif
+}
+
+// The distance from the preamble over just the most recent 16 votes, which
+// alone rules out nearly everything on an idle or noisy line.
+inline uint8_t __ask_batch_near_distance(preamble_t votes)
+{
+    preamble_t diff = votes ^ FRAME_PREAMBLE;
+    return ONES_PER_BYTE[diff & 0xff] + ONES_PER_BYTE[(diff >> 8) & 0xff];
+}
+
+// Scan forward from start for a bit period ending where the preamble might
+// be, returning the sample after it, or n if there is none before end.
+size_t __ask_batch_prefilter(struct ask_batch_worker* worker, size_t start, size_t end)
+{
+    const uint8_t max_distance = worker->reader.params.preamble_max_errors + ASK_BATCH_PREFILTER_SLACK;
+    const size_t half = DIV_PER_BIT / 2;
+    preamble_t early = 0;
+    preamble_t late = 0;
+
+    for (size_t bit = start ; bit + DIV_PER_BIT + half <= end ; bit += DIV_PER_BIT)
+    {
+        early = (early << 1) | (__ask_batch_window_ones(worker->bits, bit) >= ASK_SYMBOL_ONES_THRESHOLD);
+        late = (late << 1) | (__ask_batch_window_ones(worker->bits, bit + half) >= ASK_SYMBOL_ONES_THRESHOLD);
+
+        // Noise gives no pattern for the branch predictor to learn, so both
+        // grids are tested with the one branch.
+        if (((__ask_batch_near_distance(early) <= max_distance) |
+            (__ask_batch_near_distance(late) <= max_distance)) == 0)
+        {
+            continue;
+        }
+
+        // Until a full preamble of votes is in, the registers still hold the
+        // zeros they started with.
+        if (bit - start < ASK_BATCH_PREAMBLE_DIVS - DIV_PER_BIT)
+        {
+            continue;
+        }
+        if (__ask_preamble_distance(early) <= max_distance)
+        {
+            return bit + DIV_PER_BIT;
+        }
+        if (__ask_preamble_distance(late) <= max_distance)
+        {
+            return bit + half + DIV_PER_BIT;
+        }
+    }
+
+    return worker->n;
+}
+
+// Hand the frame the reader has just finished to the worker's list, after
+// the same FEC and FCS checks as ask_reader_process().
+void __ask_batch_complete(struct ask_batch_worker* worker, size_t offset, size_t end)
+{
+    struct ask_reader* reader = &worker->reader;
+    struct ask_frame frame = reader->frame;
+    __ask_reader_reset(reader);
+
+    // The pool buffer stays with the reader for the next frame.
+    if (frame.erasures != NULL && !__ask_fec_decode_frame(reader, &frame))
+    {
+        reader->stats.fec_failures++;
+        return;
+    }
+
+    if (!frame.fcs_ok)
+    {
+        reader->stats.fcs_errors++;
+        return;
+    }
+
+    uint8_t* data = (uint8_t*)malloc(frame.payload_byte_count + 1);
+    if (data == NULL)
+    {
+        return;
+    }
+    memcpy(data, frame.data, frame.payload_byte_count);
+    reader->stats.frames_ok++;
+    worker->frames.push_back({offset, end, data, frame.payload_byte_count});
+}
+
+void __ask_batch_run(struct ask_batch_worker* worker)
+{
+    struct ask_reader* reader = &worker->reader;
+    // Where the reader was last reset, before which a sequential reader
+    // couldn't have seen any of a preamble.
+    size_t scan_from = (worker->begin > ASK_BATCH_LEAD_DIVS ? worker->begin - ASK_BATCH_LEAD_DIVS : 0);
+    size_t cursor = scan_from;
+    // No preamble that locks within the share can end much past it.
+    size_t scan_end = (worker->finish + ASK_BATCH_LEAD_DIVS < worker->n ? worker->finish + ASK_BATCH_LEAD_DIVS : worker->n);
+
+    while (cursor < worker->finish)
+    {
+        size_t candidate = __ask_batch_prefilter(worker, cursor, scan_end);
+        if (candidate >= worker->n)
+        {
+            return;
+        }
+        worker->candidates++;
+
+        // Replay from a preamble's length before the candidate with a fresh
+        // reader, which puts the correlator in the same state as one that
+        // had been running all along.
+        size_t i = (candidate > scan_from + ASK_BATCH_LEAD_DIVS ? candidate - ASK_BATCH_LEAD_DIVS : scan_from);
+        // The last sample of the preamble, where the correlator aligned.
+        size_t preamble_end = 0;
+        bool reset = false;
+        __ask_reader_reset(reader);
+
+        for ( ; i < worker->n ; i++)
+        {
+            PACKET_READ_STAGE before = reader->stage;
+            __ask_reader_pulse(reader, __ask_batch_sample(worker->bits, i));
+
+            if (before == PREAMBLE_SCAN && reader->stage != PREAMBLE_SCAN)
+            {
+                // Frames that lock in another worker's share are theirs.
+                if (i >= worker->finish)
+                {
+                    __ask_reader_reset(reader);
+                    return;
+                }
+                if (i < worker->begin)
+                {
+                    __ask_reader_reset(reader);
+                    reset = true;
+                    break;
+                }
+                preamble_end = i - reader->preamble_state.lock_overrun;
+            }
+            else if (before != PREAMBLE_SCAN && reader->stage == PREAMBLE_SCAN)
+            {
+                // A bad symbol abandoned the frame.
+                reset = true;
+                break;
+            }
+            else if (reader->stage == FCS_READ_COMPLETE)
+            {
+                size_t offset = (preamble_end + 1 > ASK_BATCH_PREAMBLE_DIVS ? preamble_end + 1 - ASK_BATCH_PREAMBLE_DIVS : 0);
+                __ask_batch_complete(worker, offset, i + 1);
+                reset = true;
+                break;
+            }
+            else if (reader->stage == PREAMBLE_SCAN && reader->preamble_state.lock_ticks == 0 &&
+                i >= candidate + ASK_BATCH_TRAIL_DIVS)
+            {
+                // A false alarm, and the correlator has ruled out any lock
+                // up to here.
+                break;
+            }
+        }
+
+        if (i >= worker->n)
+        {
+            // The capture ended part way through a frame, which is in the
+            // pool buffer.
+            __ask_reader_reset(reader);
+            return;
+        }
+
+        // After a frame, the prefilter starts again from nothing, as the
+        // reader does. After a false alarm, it goes back far enough that its
+        // first vote completes a preamble ending just past where the
+        // correlator stopped.
+        if (reset)
+        {
+            scan_from = i + 1;
+            cursor = scan_from;
+        }
+        else
+        {
+            cursor = (i + 1 > scan_from + ASK_BATCH_PREAMBLE_DIVS ? i + 1 - ASK_BATCH_PREAMBLE_DIVS : scan_from);
+        }
+    }
+}
+
+// How many threads to split n samples between, and the share of each, which
+// is a whole number of words.
+uint32_t __ask_batch_threads(size_t n, uint32_t threads, size_t* share)
+{
+    if (threads == 0)
+    {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads > n / ASK_BATCH_MIN_THREAD_DIVS)
+    {
+        threads = n / ASK_BATCH_MIN_THREAD_DIVS;
+    }
+    if (threads == 0)
+    {
+        threads = 1;
+    }
+
+    *share = (n / threads + 63) / 64 * 64;
+    return threads;
+}
+
+// Decode every frame in n samples already packed as by __ask_batch_pack(),
+// returning the totals. bits must run to at least one whole spare word past
+// the last sample, as the prefilter reads a word at a time.
+struct ask_batch_stats ask_decode_bits(const uint64_t* bits, size_t n, struct ask_batch_params params)
+{
+    struct ask_batch_stats stats = {0, 0, 0, 0, 0};
+
+    size_t share;
+    uint32_t threads = __ask_batch_threads(n, params.threads, &share);
+    std::vector<struct ask_batch_worker> workers(threads);
+    bool pooled = true;
+    for (uint32_t t = 0 ; t < threads ; t++)
+    {
+        pooled = ask_pool_init(&workers[t].pool, ASK_MAX_PAYLOAD, 1) && pooled;
+    }
+    if (!pooled)
+    {
+        fprintf(stderr, "Unable to allocate payload buffers for %u threads\n", threads);
+        for (struct ask_batch_worker& worker : workers)
+        {
+            ask_pool_free(&worker.pool);
+        }
+        return stats;
+    }
+
+    struct ask_reader_params reader_params = {NULL, &__ask_batch_ignore, 0, params.preamble_max_errors, params.fec,
+        NULL, params.encoding, false, 0};
+    for (uint32_t t = 0 ; t < threads ; t++)
+    {
+        reader_params.pool = &workers[t].pool;
+        workers[t].bits = bits;
+        workers[t].n = n;
+        workers[t].begin = (t * share < n ? t * share : n);
+        workers[t].finish = (t + 1 == threads || (t + 1) * share > n ? n : (t + 1) * share);
+        workers[t].reader = ask_reader_init(reader_params);
+        workers[t].candidates = 0;
+    }
+
+    std::vector<std::thread> pool;
+    for (uint32_t t = 0 ; t < threads ; t++)
+    {
+        pool.push_back(std::thread(&__ask_batch_run, &workers[t]));
+    }
+    for (std::thread& thread : pool)
+    {
+        thread.join();
+    }
+
+    // A sequential reader could not have started a frame while still reading
+    // the one before, which a worker starting cold in the middle of a frame
+    // might have.
+    size_t last_end = 0;
+    for (struct ask_batch_worker& worker : workers)
+    {
+        stats.candidates += worker.candidates;
+        stats.frames_ok += worker.reader.stats.frames_ok;
+        stats.fcs_errors += worker.reader.stats.fcs_errors;
+        stats.fec_corrected += worker.reader.stats.fec_corrected;
+        stats.fec_failures += worker.reader.stats.fec_failures;
+
+        for (struct ask_batch_frame& frame : worker.frames)
+        {
+            if (frame.offset < last_end)
+            {
+                stats.frames_ok--;
+                free(frame.data);
+                continue;
+            }
+            last_end = frame.end;
+            params.frame_ready(frame.offset, frame.data, frame.datalen);
+        }
+        ask_pool_free(&worker.pool);
+    }
+
+    return stats;
+}
+
+// Decode every frame in a capture of n samples, returning the totals, or
+// zeros with the reason on stderr if there isn't the memory.
+struct ask_batch_stats ask_decode_buffer(const uint8_t* samples, size_t n, struct ask_batch_params params)
+{
+    uint64_t* bits = (uint64_t*)calloc(n / 64 + 2, sizeof(uint64_t));
+    if (bits == NULL)
+    {
+        fprintf(stderr, "Unable to allocate bits for %zu samples\n", n);
+        struct ask_batch_stats stats = {0, 0, 0, 0, 0};
+        return stats;
+    }
+
+    // Shares are whole words, so packing them in parallel never has two
+    // threads writing to one word.
+    size_t share;
+    uint32_t threads = __ask_batch_threads(n, params.threads, &share);
+    std::vector<std::thread> pool;
+    for (uint32_t t = 0 ; t < threads ; t++)
+    {
+        size_t begin = (t * share < n ? t * share : n);
+        size_t finish = (t + 1 == threads || (t + 1) * share > n ? n : (t + 1) * share);
+        pool.push_back(std::thread(&__ask_batch_pack, samples + begin, finish - begin, bits + begin / 64));
+    }
+    for (std::thread& thread : pool)
+    {
+        thread.join();
+    }
+
+    struct ask_batch_stats stats = ask_decode_bits(bits, n, params);
+    free(bits);
+    return stats;
+}
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef ASK_CAPTURE_HPP
+#define ASK_CAPTURE_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ask.hpp"
+#include "ask_batch.hpp"
+
+// Recording exactly what a reader sampled, one bit per division, so that a
+// failure seen in the field can be replayed through the decoder later, as
+// many times as needed and as fast as the host can go.
+//
+// A capture file is, all little-endian:
+// - An ask_capture_header.
+// - metadata_bytes of free-form text (where, when, which receiver, ...),
+//   zero padded to a multiple of 8 bytes.
+// - The samples, packed 64 to a 64-bit word with the first in the LSB, as
+//   __ask_batch_pack() does, followed by one spare zero word.
+//
+// The samples start 8-byte aligned, so a mapped file can be handed straight
+// to ask_decode_bits().
+
+#define ASK_CAPTURE_MAGIC "ASKCAPT"
+#define ASK_CAPTURE_VERSION 2
+
+struct ask_capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t us_per_div;
+    // The DIV_PER_BIT the reader was built with.
+    uint32_t div_per_bit;
+    uint32_t metadata_bytes;
+    uint64_t num_samples;
+    // How the tapped reader decoded the link, so that it can be replayed the
+    // same way: its line code (an ENCODING), its FEC, whether it took v2
+    // frames, and the ASK_FCS it was built with.
+    uint32_t encoding;
+    struct ask_fec_params fec;
+    uint8_t accept_v2;
+    uint8_t fcs;
+};
+
+inline size_t __ask_capture_data_offset(uint32_t metadata_bytes)
+{
+    return sizeof(struct ask_capture_header) + ((size_t)metadata_bytes + 7) / 8 * 8;
+}
+
+struct ask_capture_recorder {
+    FILE* file;
+    struct ask_capture_header header;
+    // Samples not yet written out, filling from the LSB.
+    uint64_t word;
+    // The read function of the tapped reader.
+    uint8_t(*read)();
+};
+
+// Start a capture file at path. metadata may be NULL. Returns false, with
+// the reason on stderr, if the file can't be written.
+bool ask_capture_open(struct ask_capture_recorder* recorder, const char* path, uint32_t us_per_div, const char* metadata)
+{
+    recorder->file = fopen(path, "wb");
+    if (recorder->file == NULL)
+    {
+        fprintf(stderr, "Unable to open capture %s for writing\n", path);
+        return false;
+    }
+
+    uint32_t metadata_bytes = (metadata == NULL ? 0 : strlen(metadata));
+    memcpy(recorder->header.magic, ASK_CAPTURE_MAGIC, sizeof(recorder->header.magic));
+    recorder->header.version = ASK_CAPTURE_VERSION;
+    recorder->header.us_per_div = us_per_div;
+    recorder->header.div_per_bit = DIV_PER_BIT;
+    recorder->header.metadata_bytes = metadata_bytes;
+    recorder->header.num_samples = 0;
+    // Until a reader is tapped, assume the defaults.
+    recorder->header.encoding = BALANCED_REPEATED;
+    recorder->header.fec = {0, 0};
+    recorder->header.accept_v2 = false;
+    recorder->header.fcs = ASK_FCS;
+    recorder->word = 0;
+    recorder->read = NULL;
+
+    // The sample count is filled in when the capture is closed.
+    uint8_t padding[8] = {0};
+    fwrite(&recorder->header, sizeof(recorder->header), 1, recorder->file);
+    fwrite(metadata, 1, metadata_bytes, recorder->file);
+    fwrite(padding, 1, __ask_capture_data_offset(metadata_bytes) - sizeof(recorder->header) - metadata_bytes, recorder->file);
+    return true;
+}
+
+inline void ask_capture_record(struct ask_capture_recorder* recorder, uint8_t pulse)
+{
+    recorder->word |= (uint64_t)(pulse & 1) << (recorder->header.num_samples % 64);
+    recorder->header.num_samples++;
+
+    if (recorder->header.num_samples % 64 == 0)
+    {
+        fwrite(&recorder->word, sizeof(recorder->word), 1, recorder->file);
+        recorder->word = 0;
+    }
+}
+
+// Finish off the capture, returning false if any of it failed to write.
+bool ask_capture_close(struct ask_capture_recorder* recorder)
+{
+    uint64_t spare = 0;
+    if (recorder->header.num_samples % 64 != 0)
+    {
+        fwrite(&recorder->word, sizeof(recorder->word), 1, recorder->file);
+    }
+    fwrite(&spare, sizeof(spare), 1, recorder->file);
+
+    fseek(recorder->file, 0, SEEK_SET);
+    fwrite(&recorder->header, sizeof(recorder->header), 1, recorder->file);
+
+    bool ok = !ferror(recorder->file);
+    ok = (fclose(recorder->file) == 0) && ok;
+    recorder->file = NULL;
+    if (!ok)
+    {
+        fprintf(stderr, "Error writing capture\n");
+    }
+    return ok;
+}
+
+// The read function has no context, so only one reader can be tapped at a
+// time.
+struct ask_capture_recorder* __ask_capture_tapped = NULL;
+
+uint8_t __ask_capture_tap_read()
+{
+    uint8_t pulse = __ask_capture_tapped->read();
+    ask_capture_record(__ask_capture_tapped, pulse);
+    return pulse;
+}
+
+// Record every pulse the reader's read() returns from now on, until
+// ask_capture_untap(), along with how the reader decodes them. Call this
+// before the reader's timer is started.
+void ask_capture_tap(struct ask_capture_recorder* recorder, struct ask_reader* reader)
+{
+    recorder->header.encoding = reader->params.encoding;
+    recorder->header.fec = reader->params.fec;
+    recorder->header.accept_v2 = reader->params.accept_v2;
+    recorder->read = reader->params.read;
+    __ask_capture_tapped = recorder;
+    reader->params.read = &__ask_capture_tap_read;
+}
+
+// Put the reader's own read() back. Call this once the timer is stopped.
+void ask_capture_untap(struct ask_capture_recorder* recorder, struct ask_reader* reader)
+{
+    reader->params.read = recorder->read;
+    __ask_capture_tapped = NULL;
+}
+
+// A capture file mapped into memory.
+struct ask_capture {
+    const struct ask_capture_header* header;
+    const char* metadata;
+    const uint64_t* bits;
+    size_t num_samples;
+
+    void* map;
+    size_t map_bytes;
+};
+
+// Map a capture file, returning false, with the reason on stderr, if it
+// can't be read or isn't a capture.
+bool ask_capture_load(struct ask_capture* capture, const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to open capture %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct ask_capture_header))
+    {
+        fprintf(stderr, "Capture %s is truncated\n", path);
+        close(fd);
+        return false;
+    }
+
+    capture->map_bytes = st.st_size;
+    capture->map = mmap(NULL, capture->map_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (capture->map == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map capture %s\n", path);
+        return false;
+    }
+
+    capture->header = (const struct ask_capture_header*)capture->map;
+    const struct ask_capture_header* header = capture->header;
+    if (memcmp(header->magic, ASK_CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != ASK_CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s is not a version %u capture\n", path, ASK_CAPTURE_VERSION);
+        munmap(capture->map, capture->map_bytes);
+        return false;
+    }
+
+    // Checked against the whole words there are room for, rather than the
+    // words the header asks for, which a bad sample count could wrap round.
+    size_t data_offset = __ask_capture_data_offset(header->metadata_bytes);
+    size_t data_words = (data_offset < capture->map_bytes ? (capture->map_bytes - data_offset) / sizeof(uint64_t) : 0);
+    if (data_words == 0 || header->num_samples > (data_words - 1) * 64 ||
+        header->encoding >= sizeof(ASK_LINE_CODES) / sizeof(ASK_LINE_CODES[0]))
+    {
+        fprintf(stderr, "%s is not a valid capture\n", path);
+        munmap(capture->map, capture->map_bytes);
+        return false;
+    }
+
+    if (header->div_per_bit != DIV_PER_BIT)
+    {
+        fprintf(stderr, "Warning: %s was captured with DIV_PER_BIT %u, not %u\n",
+            path, header->div_per_bit, DIV_PER_BIT);
+    }
+    if (header->fcs != ASK_FCS)
+    {
+        fprintf(stderr, "Warning: %s was captured with ASK_FCS %u, not %u, so every frame will fail its FCS\n",
+            path, header->fcs, ASK_FCS);
+    }
+
+    capture->metadata = (const char*)capture->map + sizeof(struct ask_capture_header);
+    capture->bits = (const uint64_t*)((const uint8_t*)capture->map + data_offset);
+    capture->num_samples = header->num_samples;
+
+    // Replay reads straight through the file once.
+    madvise(capture->map, capture->map_bytes, MADV_SEQUENTIAL);
+    return true;
+}
+
+void ask_capture_unload(struct ask_capture* capture)
+{
+    munmap(capture->map, capture->map_bytes);
+    capture->map = NULL;
+}
+
+const struct ask_capture* __ask_capture_replaying = NULL;
+size_t __ask_capture_replay_cursor = 0;
+
+uint8_t __ask_capture_replay_read()
+{
+    size_t i = __ask_capture_replay_cursor++;
+    return (__ask_capture_replaying->bits[i / 64] >> (i % 64)) & 1;
+}
+
+// Feed every sample in the capture through ask_reader_callback(), and
+// deliver the frames with ask_reader_process(), with no waiting between
+// divisions. The reader's own read() is put back afterwards.
+void ask_capture_replay(const struct ask_capture* capture, struct ask_reader* reader)
+{
+    uint8_t(*read)() = reader->params.read;
+    __ask_capture_replaying = capture;
+    __ask_capture_replay_cursor = 0;
+    reader->params.read = &__ask_capture_replay_read;
+
+    for (size_t i = 0 ; i < capture->num_samples ; i++)
+    {
+        ask_reader_callback(reader);
+        ask_reader_process(reader);
+    }
+
+    // A frame ending on the last sample is only handed off at the next
+    // pulse, which reads the spare zero word after the capture.
+    if (reader->stage == FCS_READ_COMPLETE)
+    {
+        ask_reader_callback(reader);
+        ask_reader_process(reader);
+    }
+
+    reader->params.read = read;
+    __ask_capture_replaying = NULL;
+}
+
+// Decode the capture with the offline decoder instead, which doesn't need
+// a reader at all.
+struct ask_batch_stats ask_capture_decode(const struct ask_capture* capture, struct ask_batch_params params)
+{
+    return ask_decode_bits(capture->bits, capture->num_samples, params);
+}
+
+#endif
@@ -0,0 +1,441 @@
+#ifndef ASK_CODEC_HPP
+#define ASK_CODEC_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ask.hpp"
+
+// A codec specialised at compile time for one link profile, so that several
+// profiles can run side by side in one binary, and the hot loops have no
+// runtime branches on the configuration.
+//
+// The on-air format is the same as ask.hpp's: a raw 4-bit nybble preamble,
+// then the length, payload and checksum as SymbolBits-bit symbols, each byte
+// sent last byte first, high nybble first, MSB first. AskCodec<DIV_PER_BIT,
+// 6, preamble_t, ask_len_t> produces exactly the pulses of ask_encode_frame().
+
+// Lookup tables, generated at compile time from the 4b6b code in SYMBOLS46.
+struct ask_codec_tables {
+    uint8_t ones_per_byte[256];
+    // 0xf0 for 6-bit words that are not a symbol.
+    uint8_t symbols64[64];
+};
+
+constexpr struct ask_codec_tables __ask_codec_make_tables()
+{
+    struct ask_codec_tables tables = {};
+
+    for (int i = 0 ; i < 256 ; i++)
+    {
+        uint8_t ones = 0;
+        for (int b = 0 ; b < 8 ; b++)
+        {
+            ones += (i >> b) & 1;
+        }
+        tables.ones_per_byte[i] = ones;
+    }
+
+    for (int i = 0 ; i < 64 ; i++)
+    {
+        tables.symbols64[i] = 0xf0;
+    }
+    for (int i = 0 ; i < 16 ; i++)
+    {
+        tables.symbols64[SYMBOLS46[i]] = i;
+    }
+
+    return tables;
+}
+
+static constexpr struct ask_codec_tables ASK_CODEC_TABLES = __ask_codec_make_tables();
+
+// FRAME_PREAMBLE repeated to fill a preamble of any width.
+template <class PreambleT>
+constexpr PreambleT __ask_codec_preamble()
+{
+    PreambleT preamble = 0;
+    for (unsigned i = 0 ; i < sizeof(PreambleT) ; i += sizeof(uint32_t))
+    {
+        preamble = (PreambleT)((preamble << (8 * (sizeof(PreambleT) > 4 ? 4 : 0))) | FRAME_PREAMBLE);
+    }
+    return preamble;
+}
+
+template <uint8_t DivPerBit, uint8_t SymbolBits, class PreambleT = preamble_t, class LenT = ask_len_t>
+struct AskCodec
+{
+    static_assert(SymbolBits == 4 || SymbolBits == 6, "symbols are raw nybbles or 4b6b");
+    static_assert(DivPerBit >= 2 && DivPerBit <= 16, "the pulse window holds up to 16 divisions");
+
+    static constexpr PreambleT preamble = __ask_codec_preamble<PreambleT>();
+
+    // The symbol reader's PLL, as described alongside ASK_PLL_RAMP_INC.
+    static constexpr int16_t pll_ramp_inc = ASK_PLL_RAMP_INC;
+    static constexpr int16_t pll_ramp_len = pll_ramp_inc * DivPerBit;
+    static constexpr uint8_t symbol_ones_threshold = DivPerBit / 2 + 1;
+    static constexpr uint8_t preamble_ones_threshold = DivPerBit * 3 / 4;
+
+    static constexpr ask_len_t frame_divisions(LenT payload_byte_count)
+    {
+        return (
+            sizeof(PreambleT) * 2 * 4 +
+            (sizeof(LenT) + sizeof(checksum_t) + payload_byte_count) * 2 * SymbolBits
+            ) * DivPerBit;
+    }
+
+    // Set the DivPerBit divisions of one bit at once, rather than one by one.
+    static inline void set_bit_divisions(ask_pulse_word_t* bits_out, ask_len_t bit_cursor)
+    {
+        constexpr uint64_t ones = (1ull << DivPerBit) - 1;
+        uint64_t mask = ones << (bit_cursor % ASK_PULSES_PER_WORD);
+        bits_out[bit_cursor / ASK_PULSES_PER_WORD] |= (ask_pulse_word_t)mask;
+        if (bit_cursor % ASK_PULSES_PER_WORD + DivPerBit > ASK_PULSES_PER_WORD)
+        {
+            bits_out[bit_cursor / ASK_PULSES_PER_WORD + 1] |= (ask_pulse_word_t)(mask >> ASK_PULSES_PER_WORD);
+        }
+    }
+
+    // The output stream is expected to be zeroed, as for ask_encode_bytes().
+    template <uint8_t Bits>
+    static ask_len_t encode_bytes(const uint8_t* bytes_in, ask_len_t numbytes, ask_pulse_word_t* bits_out, ask_len_t bit_offset)
+    {
+        ask_len_t bit_cursor = bit_offset;
+
+        for (ask_len_t b = numbytes - 1 ; b >= 0 ; b--)
+        {
+            uint8_t nybbles[2] = {(uint8_t)(bytes_in[b] >> 4), (uint8_t)(bytes_in[b] & 0xf)};
+            for (int n = 0 ; n < 2 ; n++)
+            {
+                uint8_t bits = (Bits == 6 ? SYMBOLS46[nybbles[n]] : nybbles[n]);
+                #pragma GCC unroll 6
+                for (int i = Bits - 1 ; i >= 0 ; i--)
+                {
+                    if ((bits >> i) & 1)
+                    {
+                        set_bit_divisions(bits_out, bit_cursor);
+                    }
+                    bit_cursor += DivPerBit;
+                }
+            }
+        }
+
+        return bit_cursor - bit_offset;
+    }
+
+    static checksum_t fcs(const uint8_t* data, LenT payload_byte_count)
+    {
+        PreambleT frame_preamble = preamble;
+        checksum_t fcs = __ask_fcs_update(ASK_FCS_INIT, (uint8_t*)&frame_preamble, sizeof(PreambleT));
+        fcs = __ask_fcs_update(fcs, (uint8_t*)&payload_byte_count, sizeof(LenT));
+        return __ask_fcs_finish(__ask_fcs_update(fcs, (uint8_t*)data, payload_byte_count));
+    }
+
+    // Encode a whole frame into a freshly allocated pulse stream, ready for
+    // ask_write_pulses().
+    static ask_pulse_word_t* encode_frame(const uint8_t* data, LenT payload_byte_count, ask_len_t* numbits_out)
+    {
+        ask_len_t numbits = frame_divisions(payload_byte_count);
+        *numbits_out = numbits;
+        ask_pulse_word_t* bit_stream = (ask_pulse_word_t*)calloc(
+            ASK_PULSE_WORDS(numbits), sizeof(ask_pulse_word_t));
+
+        PreambleT frame_preamble = preamble;
+        checksum_t checksum = fcs(data, payload_byte_count);
+
+        ask_len_t bit_cursor = 0;
+        bit_cursor += encode_bytes<4>((uint8_t*)&frame_preamble, sizeof(PreambleT), bit_stream, bit_cursor);
+        bit_cursor += encode_bytes<SymbolBits>((uint8_t*)&payload_byte_count, sizeof(LenT), bit_stream, bit_cursor);
+        bit_cursor += encode_bytes<SymbolBits>(data, payload_byte_count, bit_stream, bit_cursor);
+        bit_cursor += encode_bytes<SymbolBits>((uint8_t*)&checksum, sizeof(checksum_t), bit_stream, bit_cursor);
+
+        return bit_stream;
+    }
+
+    struct reader_params {
+        // Called with NULL when a frame is abandoned part way through.
+        void(*datagram_ready)(uint8_t* data, LenT datalen);
+        uint8_t preamble_max_errors;
+        // The longest payload accepted, as a longer length must be corrupt.
+        // 0 for any whose symbols can be counted, up to INT32_MAX / 2.
+        LenT mtu;
+    };
+
+    struct reader_stats {
+        uint32_t frames_ok;
+        uint32_t fcs_errors;
+        uint32_t symbol_errors;
+    };
+
+    // The same decoder as ask_reader: a sliding preamble correlator locked on
+    // the middle of the best run, then a PLL-timed symbol reader. Frames are
+    // validated and delivered straight from read().
+    struct reader {
+        struct reader_params params;
+        PACKET_READ_STAGE stage;
+
+        uint32_t pulse_window;
+        uint8_t pulse_window_ones;
+        uint8_t phase;
+        PreambleT phase_preambles[DivPerBit];
+        uint8_t lock_ticks;
+        uint8_t lock_best_distance;
+        uint8_t lock_best_start;
+        uint8_t lock_best_end;
+
+        uint8_t symbol;
+        uint8_t symbol_bits;
+        uint8_t bit_ones;
+        uint8_t last_pulse;
+        uint8_t run_length;
+        int16_t pll_ramp;
+        bool pll_pending;
+        int16_t pll_error;
+
+        uint8_t* output;
+        ask_len_t num_symbols;
+        LenT payload_byte_count;
+        uint8_t* data;
+        checksum_t checksum;
+
+        struct reader_stats stats;
+    };
+
+    static void reader_reset(struct reader* reader)
+    {
+        struct reader_params params = reader->params;
+        struct reader_stats stats = reader->stats;
+        memset(reader, 0, sizeof(struct reader));
+        reader->params = params;
+        reader->stats = stats;
+        reader->stage = PREAMBLE_SCAN;
+    }
+
+    static struct reader reader_init(struct reader_params params)
+    {
+        struct reader reader;
+        reader.params = params;
+        reader.stats = {0,0,0};
+        reader_reset(&reader);
+        return reader;
+    }
+
+    static inline uint8_t preamble_distance(PreambleT candidate)
+    {
+        PreambleT diff = candidate ^ preamble;
+        uint8_t distance = 0;
+        #pragma GCC unroll 8
+        for (unsigned i = 0 ; i < sizeof(PreambleT) ; i++)
+        {
+            distance += ASK_CODEC_TABLES.ones_per_byte[(diff >> (8 * i)) & 0xff];
+        }
+        return distance;
+    }
+
+    // Returns true once the preamble is locked, with lock_overrun pulses of
+    // the first symbol already in the pulse window.
+    static inline bool read_preamble(struct reader* reader, uint8_t pulse, uint8_t* lock_overrun)
+    {
+        uint8_t outgoing = (reader->pulse_window >> (DivPerBit - 1)) & 1;
+        reader->pulse_window = (reader->pulse_window << 1) | pulse;
+        reader->pulse_window_ones += pulse - outgoing;
+
+        PreambleT candidate = (PreambleT)(reader->phase_preambles[reader->phase] << 1) |
+            (reader->pulse_window_ones >= preamble_ones_threshold);
+        reader->phase_preambles[reader->phase] = candidate;
+        reader->phase = (reader->phase + 1 == DivPerBit ? 0 : reader->phase + 1);
+
+        uint8_t distance = preamble_distance(candidate);
+
+        if (reader->lock_ticks == 0)
+        {
+            if (distance > reader->params.preamble_max_errors)
+            {
+                return false;
+            }
+
+            reader->lock_best_distance = distance;
+            reader->lock_best_start = 0;
+            reader->lock_best_end = 0;
+        }
+        else if (distance < reader->lock_best_distance)
+        {
+            reader->lock_best_distance = distance;
+            reader->lock_best_start = reader->lock_ticks;
+            reader->lock_best_end = reader->lock_ticks;
+        }
+        else if (distance == reader->lock_best_distance &&
+            reader->lock_best_end == reader->lock_ticks - 1)
+        {
+            reader->lock_best_end = reader->lock_ticks;
+        }
+
+        reader->lock_ticks++;
+        if (reader->lock_ticks < DivPerBit)
+        {
+            return false;
+        }
+
+        *lock_overrun = (DivPerBit - 1) - (reader->lock_best_start + reader->lock_best_end) / 2;
+        return true;
+    }
+
+    // One pulse into the PLL and symbol shift register, as __ask_read_pulse().
+    static inline void read_pulse(struct reader* reader, uint8_t pulse)
+    {
+        reader->bit_ones += pulse;
+
+        if (pulse != reader->last_pulse)
+        {
+            int16_t error = reader->pll_ramp - pll_ramp_inc / 2;
+            if (error >= pll_ramp_len / 2)
+            {
+                error -= pll_ramp_len;
+            }
+
+            reader->pll_pending = (reader->run_length >= 2);
+            reader->pll_error = error;
+            reader->last_pulse = pulse;
+            reader->run_length = 1;
+        }
+        else
+        {
+            if (reader->pll_pending)
+            {
+                reader->pll_ramp -= reader->pll_error / ASK_PLL_GAIN_DIV;
+                reader->pll_pending = false;
+            }
+
+            if (reader->run_length < 0xff)
+            {
+                reader->run_length++;
+            }
+        }
+
+        reader->pll_ramp += pll_ramp_inc;
+
+        if (reader->pll_ramp >= pll_ramp_len)
+        {
+            reader->symbol = (reader->symbol << 1) | (reader->bit_ones >= symbol_ones_threshold);
+            reader->symbol_bits++;
+            reader->bit_ones = 0;
+            reader->pll_ramp -= pll_ramp_len;
+        }
+    }
+
+    static void abandon_frame(struct reader* reader)
+    {
+        reader->stats.symbol_errors++;
+        reader->params.datagram_ready(NULL, 0);
+        if (reader->data != NULL)
+        {
+            free(reader->data);
+        }
+        reader_reset(reader);
+    }
+
+    static void read_symbols(struct reader* reader, uint8_t pulse)
+    {
+        read_pulse(reader, pulse);
+        if (reader->symbol_bits != SymbolBits)
+        {
+            return;
+        }
+
+        uint8_t nybble = (SymbolBits == 6 ? ASK_CODEC_TABLES.symbols64[reader->symbol & 0x3f] : reader->symbol & 0xf);
+        reader->symbol = 0;
+        reader->symbol_bits = 0;
+        if (nybble == 0xf0)
+        {
+            abandon_frame(reader);
+            return;
+        }
+
+        reader->num_symbols--;
+        reader->output[reader->num_symbols / 2] |= nybble << 4 * (reader->num_symbols % 2);
+        if (reader->num_symbols > 0)
+        {
+            return;
+        }
+
+        if (reader->stage == PAYLOAD_LENGTH_READ)
+        {
+            // A length off the air is only trusted as far as it can be held,
+            // and its symbols counted. Widened, a negative length from a
+            // signed LenT (or a huge unsigned one) is below 0.
+            int64_t len = (int64_t)reader->payload_byte_count;
+            int64_t max_len = (reader->params.mtu > 0 ? (int64_t)reader->params.mtu : INT32_MAX / 2);
+            if (len < 0 || len > max_len)
+            {
+                abandon_frame(reader);
+                return;
+            }
+
+            // One spare byte, so that an empty payload is still not NULL.
+            reader->data = (uint8_t*)calloc((size_t)reader->payload_byte_count + 1, sizeof(uint8_t));
+            if (reader->data == NULL)
+            {
+                abandon_frame(reader);
+                return;
+            }
+            reader->stage = PAYLOAD_READ;
+            reader->num_symbols = 2 * reader->payload_byte_count;
+            reader->output = reader->data;
+            if (reader->num_symbols > 0)
+            {
+                return;
+            }
+        }
+
+        if (reader->stage == PAYLOAD_READ)
+        {
+            reader->stage = FCS_READ;
+            reader->num_symbols = 2 * sizeof(checksum_t);
+            reader->output = (uint8_t*)&reader->checksum;
+            return;
+        }
+
+        if (fcs(reader->data, reader->payload_byte_count) == reader->checksum)
+        {
+            reader->stats.frames_ok++;
+            reader->params.datagram_ready(reader->data, reader->payload_byte_count);
+        }
+        else
+        {
+            reader->stats.fcs_errors++;
+            free(reader->data);
+        }
+        reader->data = NULL;
+        reader_reset(reader);
+    }
+
+    static void read(struct reader* reader, uint8_t pulse)
+    {
+        if (reader->stage != PREAMBLE_SCAN)
+        {
+            read_symbols(reader, pulse);
+            return;
+        }
+
+        uint8_t lock_overrun;
+        if (!read_preamble(reader, pulse, &lock_overrun))
+        {
+            return;
+        }
+
+        reader->stage = PAYLOAD_LENGTH_READ;
+        reader->num_symbols = 2 * sizeof(LenT);
+        reader->output = (uint8_t*)&reader->payload_byte_count;
+        reader->last_pulse = (reader->pulse_window >> lock_overrun) & 1;
+        reader->run_length = DivPerBit;
+        reader->pll_ramp = pll_ramp_inc / 2;
+
+        for (int i = lock_overrun - 1 ; i >= 0 ; i--)
+        {
+            read_symbols(reader, (reader->pulse_window >> i) & 1);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,512 @@
+#ifndef ASK_FEC_HPP
+#define ASK_FEC_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Optional forward error correction of the payload, so that a frame with a
+// few bad symbols can be repaired rather than dropped.
+//
+// The payload is cut into blocks of at most block_bytes bytes, and each is
+// given parity_bytes of Reed-Solomon parity over GF(2^8). Each block can
+// then correct up to parity_bytes erasures (bytes known to be bad, such as
+// those with an invalid 4b6b symbol), or half that many errors at unknown
+// positions, or any mix where 2 * errors + erasures <= parity_bytes.
+//
+// The blocks are sent interleaved byte by byte (byte 0 of every block, then
+// byte 1 of every block, ...), so that a burst of noise is spread over every
+// block in the frame, rather than overwhelming one of them.
+struct ask_fec_params {
+    // Zero turns FEC off.
+    uint8_t parity_bytes;
+    // parity_bytes + block_bytes must be at most 255, and parity_bytes at
+    // most ASK_FEC_MAX_PARITY.
+    uint8_t block_bytes;
+};
+
+#define ASK_FEC_MAX_PARITY 32
+#define ASK_FEC_MAX_BLOCK 255
+
+// log and antilog tables for GF(2^8) with the polynomial x^8+x^4+x^3+x^2+1.
+// The antilog table is doubled so a product never needs reducing mod 255.
+struct ask_gf_tables {
+    uint8_t exp[512];
+    uint8_t log[256];
+};
+
+constexpr struct ask_gf_tables __ask_gf_make_tables()
+{
+    struct ask_gf_tables tables = {};
+    uint16_t x = 1;
+    for (int i = 0 ; i < 255 ; i++)
+    {
+        tables.exp[i] = x;
+        tables.log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+        {
+            x ^= 0x11d;
+        }
+    }
+    for (int i = 255 ; i < 512 ; i++)
+    {
+        tables.exp[i] = tables.exp[i - 255];
+    }
+    return tables;
+}
+
+static constexpr struct ask_gf_tables ASK_GF = __ask_gf_make_tables();
+
+inline uint8_t __ask_gf_mul(uint8_t x, uint8_t y)
+{
+    if (x == 0 || y == 0)
+    {
+        return 0;
+    }
+    return ASK_GF.exp[ASK_GF.log[x] + ASK_GF.log[y]];
+}
+
+inline uint8_t __ask_gf_div(uint8_t x, uint8_t y)
+{
+    if (x == 0)
+    {
+        return 0;
+    }
+    return ASK_GF.exp[(ASK_GF.log[x] + 255 - ASK_GF.log[y]) % 255];
+}
+
+// alpha^power, for any (including negative) power.
+inline uint8_t __ask_gf_alpha(int power)
+{
+    return ASK_GF.exp[((power % 255) + 255) % 255];
+}
+
+// Polynomials are stored highest degree first, as in most RS references.
+struct ask_gf_poly {
+    uint8_t c[ASK_FEC_MAX_BLOCK + 1];
+    int len;
+};
+
+uint8_t __ask_gf_poly_eval(const uint8_t* p, int len, uint8_t x)
+{
+    uint8_t y = p[0];
+    for (int i = 1 ; i < len ; i++)
+    {
+        y = __ask_gf_mul(y, x) ^ p[i];
+    }
+    return y;
+}
+
+void __ask_gf_poly_mul(const struct ask_gf_poly* p, const struct ask_gf_poly* q, struct ask_gf_poly* out)
+{
+    out->len = p->len + q->len - 1;
+    memset(out->c, 0, out->len);
+    for (int j = 0 ; j < q->len ; j++)
+    {
+        for (int i = 0 ; i < p->len ; i++)
+        {
+            out->c[i + j] ^= __ask_gf_mul(p->c[i], q->c[j]);
+        }
+    }
+}
+
+void __ask_rs_generator(uint8_t nsym, struct ask_gf_poly* g)
+{
+    g->c[0] = 1;
+    g->len = 1;
+    for (int i = 0 ; i < nsym ; i++)
+    {
+        struct ask_gf_poly factor = {{1, __ask_gf_alpha(i)}, 2};
+        struct ask_gf_poly product;
+        __ask_gf_poly_mul(g, &factor, &product);
+        *g = product;
+    }
+}
+
+// Append nsym parity bytes to the len data bytes at block.
+void __ask_rs_encode(uint8_t* block, int len, uint8_t nsym, const struct ask_gf_poly* g)
+{
+    memset(block + len, 0, nsym);
+    for (int i = 0 ; i < len ; i++)
+    {
+        uint8_t coef = block[i] ^ block[len];
+        memmove(block + len, block + len + 1, nsym - 1);
+        block[len + nsym - 1] = 0;
+        if (coef != 0)
+        {
+            for (int j = 1 ; j < g->len ; j++)
+            {
+                block[len + j - 1] ^= __ask_gf_mul(g->c[j], coef);
+            }
+        }
+    }
+}
+
+// Correct a received block of len bytes in place, given the positions of
+// num_erasures bytes already known to be bad. Returns the number of bytes
+// corrected, or -1 if the block is beyond repair.
+int __ask_rs_decode(uint8_t* block, int len, uint8_t nsym, const uint8_t* erasures, int num_erasures)
+{
+    if (nsym > ASK_FEC_MAX_PARITY || num_erasures > nsym)
+    {
+        return -1;
+    }
+
+    for (int i = 0 ; i < num_erasures ; i++)
+    {
+        block[erasures[i]] = 0;
+    }
+
+    uint8_t synd[ASK_FEC_MAX_PARITY];
+    bool clean = true;
+    for (int i = 0 ; i < nsym ; i++)
+    {
+        synd[i] = __ask_gf_poly_eval(block, len, __ask_gf_alpha(i));
+        clean = clean && (synd[i] == 0);
+    }
+    if (clean)
+    {
+        return 0;
+    }
+
+    // Fold the known erasures out of the syndromes, leaving only the
+    // unknown errors for Berlekamp-Massey to find.
+    uint8_t fsynd[ASK_FEC_MAX_PARITY];
+    memcpy(fsynd, synd, nsym);
+    for (int i = 0 ; i < num_erasures ; i++)
+    {
+        uint8_t x = __ask_gf_alpha(len - 1 - erasures[i]);
+        for (int j = 0 ; j < nsym - 1 ; j++)
+        {
+            fsynd[j] = __ask_gf_mul(fsynd[j], x) ^ fsynd[j + 1];
+        }
+    }
+
+    // Berlekamp-Massey, with polynomials highest degree first.
+    struct ask_gf_poly err_loc = {{1}, 1};
+    struct ask_gf_poly old_loc = {{1}, 1};
+    for (int i = 0 ; i < nsym - num_erasures ; i++)
+    {
+        uint8_t delta = fsynd[i];
+        for (int j = 1 ; j < err_loc.len ; j++)
+        {
+            delta ^= __ask_gf_mul(err_loc.c[err_loc.len - 1 - j], fsynd[i - j]);
+        }
+
+        old_loc.c[old_loc.len++] = 0;
+        if (delta == 0)
+        {
+            continue;
+        }
+
+        if (old_loc.len > err_loc.len)
+        {
+            struct ask_gf_poly new_loc = old_loc;
+            for (int j = 0 ; j < new_loc.len ; j++)
+            {
+                new_loc.c[j] = __ask_gf_mul(new_loc.c[j], delta);
+            }
+            old_loc = err_loc;
+            for (int j = 0 ; j < old_loc.len ; j++)
+            {
+                old_loc.c[j] = __ask_gf_div(old_loc.c[j], delta);
+            }
+            err_loc = new_loc;
+        }
+
+        // err_loc += delta * old_loc, aligned on the lowest degree.
+        for (int j = 0 ; j < old_loc.len ; j++)
+        {
+            err_loc.c[err_loc.len - old_loc.len + j] ^= __ask_gf_mul(old_loc.c[j], delta);
+        }
+    }
+
+    int lead = 0;
+    while (lead < err_loc.len && err_loc.c[lead] == 0)
+    {
+        lead++;
+    }
+    int num_errors = err_loc.len - lead - 1;
+    if (2 * num_errors + num_erasures > nsym)
+    {
+        return -1;
+    }
+
+    // Chien search for the roots of the (reversed) error locator.
+    uint8_t errata[ASK_FEC_MAX_PARITY];
+    int num_errata = 0;
+    for (int i = 0 ; i < num_erasures ; i++)
+    {
+        errata[num_errata++] = erasures[i];
+    }
+    int found = 0;
+    for (int i = 0 ; i < len && num_errors > 0 ; i++)
+    {
+        // Evaluating the reversed polynomial is evaluating the original at
+        // the inverse point.
+        uint8_t y = 0;
+        for (int j = err_loc.len - 1 ; j >= lead ; j--)
+        {
+            y = __ask_gf_mul(y, __ask_gf_alpha(i)) ^ err_loc.c[j];
+        }
+        if (y == 0)
+        {
+            if (found == num_errors)
+            {
+                return -1;
+            }
+            errata[num_errata++] = len - 1 - i;
+            found++;
+        }
+    }
+    if (found != num_errors)
+    {
+        return -1;
+    }
+
+    // Forney: the errata locator and evaluator give each error's magnitude.
+    struct ask_gf_poly locator = {{1}, 1};
+    for (int i = 0 ; i < num_errata ; i++)
+    {
+        struct ask_gf_poly factor = {{__ask_gf_alpha(len - 1 - errata[i]), 1}, 2};
+        struct ask_gf_poly product;
+        __ask_gf_poly_mul(&locator, &factor, &product);
+        locator = product;
+    }
+
+    // The syndrome polynomial is S(x) = sum(synd[i] x^(i+1)), and the errata
+    // evaluator is S(x) times the locator, mod x^(locator.len).
+    struct ask_gf_poly synd_poly;
+    synd_poly.len = nsym + 1;
+    for (int i = 0 ; i < nsym ; i++)
+    {
+        synd_poly.c[i] = synd[nsym - 1 - i];
+    }
+    synd_poly.c[nsym] = 0;
+    struct ask_gf_poly product;
+    __ask_gf_poly_mul(&synd_poly, &locator, &product);
+    uint8_t evaluator[ASK_FEC_MAX_PARITY + 1];
+    int evaluator_len = locator.len;
+    for (int i = 0 ; i < evaluator_len ; i++)
+    {
+        evaluator[i] = product.c[product.len - evaluator_len + i];
+    }
+
+    for (int i = 0 ; i < num_errata ; i++)
+    {
+        uint8_t xi = __ask_gf_alpha(len - 1 - errata[i]);
+        uint8_t xi_inv = __ask_gf_div(1, xi);
+
+        uint8_t loc_prime = 1;
+        for (int j = 0 ; j < num_errata ; j++)
+        {
+            if (j != i)
+            {
+                loc_prime = __ask_gf_mul(loc_prime,
+                    1 ^ __ask_gf_mul(xi_inv, __ask_gf_alpha(len - 1 - errata[j])));
+            }
+        }
+        if (loc_prime == 0)
+        {
+            return -1;
+        }
+
+        uint8_t y = __ask_gf_mul(xi, __ask_gf_poly_eval(evaluator, evaluator_len, xi_inv));
+        block[errata[i]] ^= __ask_gf_div(y, loc_prime);
+    }
+
+    for (int i = 0 ; i < nsym ; i++)
+    {
+        if (__ask_gf_poly_eval(block, len, __ask_gf_alpha(i)) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return num_errata;
+}
+
+inline bool ask_fec_enabled(const struct ask_fec_params* params)
+{
+    return params->parity_bytes > 0;
+}
+
+// Whether the params are within the limits above. FEC that is off is valid
+// whatever block_bytes is.
+inline bool ask_fec_valid(const struct ask_fec_params* params)
+{
+    if (!ask_fec_enabled(params))
+    {
+        return true;
+    }
+    return params->parity_bytes <= ASK_FEC_MAX_PARITY && params->block_bytes > 0 &&
+        params->parity_bytes + params->block_bytes <= ASK_FEC_MAX_BLOCK;
+}
+
+inline int32_t __ask_fec_blocks(const struct ask_fec_params* params, int32_t datalen)
+{
+    return (datalen + params->block_bytes - 1) / params->block_bytes;
+}
+
+// Bytes of data carried by block i. The data is spread evenly, with the
+// first blocks taking one extra byte where it does not divide exactly.
+inline int32_t __ask_fec_block_data(int32_t datalen, int32_t blocks, int32_t i)
+{
+    return datalen / blocks + (i < datalen % blocks);
+}
+
+// The encoded length of a datalen byte payload, or -1 if the params are invalid.
+int32_t ask_fec_encoded_len(const struct ask_fec_params* params, int32_t datalen)
+{
+    if (!ask_fec_valid(params))
+    {
+        return -1;
+    }
+    return datalen + __ask_fec_blocks(params, datalen) * params->parity_bytes;
+}
+
+// The payload length for an encoded length, or -1 if no payload encodes to it.
+int32_t ask_fec_decoded_len(const struct ask_fec_params* params, int32_t encoded_len)
+{
+    if (!ask_fec_valid(params))
+    {
+        return -1;
+    }
+
+    int32_t stride = params->block_bytes + params->parity_bytes;
+    int32_t blocks = (encoded_len + stride - 1) / stride;
+    int32_t datalen = encoded_len - blocks * params->parity_bytes;
+    if (encoded_len < 0 || datalen < 0 || ask_fec_encoded_len(params, datalen) != encoded_len)
+    {
+        return -1;
+    }
+    return datalen;
+}
+
+// Call f(block, offset) for each encoded byte in on-air order, where offset
+// is its position within its block.
+template <class callable>
+void __ask_fec_interleave(int32_t datalen, int32_t blocks, uint8_t parity_bytes, callable&& f)
+{
+    if (blocks == 0)
+    {
+        return;
+    }
+
+    int32_t longest = __ask_fec_block_data(datalen, blocks, 0) + parity_bytes;
+    for (int32_t offset = 0 ; offset < longest ; offset++)
+    {
+        for (int32_t i = 0 ; i < blocks ; i++)
+        {
+            if (offset < __ask_fec_block_data(datalen, blocks, i) + parity_bytes)
+            {
+                f(i, offset);
+            }
+        }
+    }
+}
+
+// Encode datalen bytes into ask_fec_encoded_len() bytes at out. Returns false
+// if the params are invalid or out of memory.
+bool ask_fec_encode(const struct ask_fec_params* params, const uint8_t* data, int32_t datalen, uint8_t* out)
+{
+    if (!ask_fec_valid(params))
+    {
+        return false;
+    }
+
+    int32_t blocks = __ask_fec_blocks(params, datalen);
+    int32_t stride = params->block_bytes + params->parity_bytes;
+    uint8_t* coded = (uint8_t*)malloc(blocks * stride + 1);
+    if (coded == NULL)
+    {
+        return false;
+    }
+
+    struct ask_gf_poly g;
+    __ask_rs_generator(params->parity_bytes, &g);
+
+    const uint8_t* in = data;
+    for (int32_t i = 0 ; i < blocks ; i++)
+    {
+        int32_t len = __ask_fec_block_data(datalen, blocks, i);
+        memcpy(coded + i * stride, in, len);
+        __ask_rs_encode(coded + i * stride, len, params->parity_bytes, &g);
+        in += len;
+    }
+
+    uint8_t* cursor = out;
+    __ask_fec_interleave(datalen, blocks, params->parity_bytes, [&](int32_t block, int32_t offset) {
+        *cursor++ = coded[block * stride + offset];
+    });
+
+    free(coded);
+    return true;
+}
+
+// Decode encoded_len bytes, of which those flagged in the erasures bitmap
+// (bit k of byte k / 8, may be NULL) are known to be bad, into out.
+// Returns the payload length, or -1 if any block could not be repaired (or
+// the params are invalid, or out of memory).
+// The number of bytes corrected is added to *corrected.
+int32_t ask_fec_decode(const struct ask_fec_params* params, const uint8_t* encoded, int32_t encoded_len,
+    const uint8_t* erasures, uint8_t* out, uint32_t* corrected)
+{
+    int32_t datalen = ask_fec_decoded_len(params, encoded_len);
+    if (datalen < 0)
+    {
+        return -1;
+    }
+
+    int32_t blocks = __ask_fec_blocks(params, datalen);
+    int32_t stride = params->block_bytes + params->parity_bytes;
+    uint8_t* coded = (uint8_t*)malloc(blocks * stride + 1);
+    uint8_t* erased = (uint8_t*)calloc(blocks + 1, ASK_FEC_MAX_PARITY + 1);
+    uint8_t* num_erased = (uint8_t*)calloc(blocks + 1, 1);
+    if (coded == NULL || erased == NULL || num_erased == NULL)
+    {
+        free(num_erased);
+        free(erased);
+        free(coded);
+        return -1;
+    }
+
+    int32_t k = 0;
+    __ask_fec_interleave(datalen, blocks, params->parity_bytes, [&](int32_t block, int32_t offset) {
+        coded[block * stride + offset] = encoded[k];
+        if (erasures != NULL && (erasures[k / 8] >> (k % 8)) & 1)
+        {
+            // Past the limit, the block fails anyway, so stop counting.
+            if (num_erased[block] <= ASK_FEC_MAX_PARITY)
+            {
+                erased[block * (ASK_FEC_MAX_PARITY + 1) + num_erased[block]++] = offset;
+            }
+        }
+        k++;
+    });
+
+    int32_t result = datalen;
+    uint8_t* cursor = out;
+    for (int32_t i = 0 ; i < blocks ; i++)
+    {
+        int32_t len = __ask_fec_block_data(datalen, blocks, i);
+        int fixed = __ask_rs_decode(coded + i * stride, len + params->parity_bytes, params->parity_bytes,
+            erased + i * (ASK_FEC_MAX_PARITY + 1), num_erased[i]);
+        if (fixed < 0)
+        {
+            result = -1;
+            break;
+        }
+        *corrected += fixed;
+        memcpy(cursor, coded + i * stride, len);
+        cursor += len;
+    }
+
+    free(num_erased);
+    free(erased);
+    free(coded);
+    return result;
+}
+
+#endif
@@ -0,0 +1,609 @@
+#ifndef ASK_SIM_HPP
+#define ASK_SIM_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <random>
+#include <vector>
+
+#include "ask.hpp"
+#include "ask_arq.hpp"
+
+// A deterministic simulation of a writer and a reader talking over a noisy
+// channel, on a virtual clock rather than timers, so a run takes as long as
+// the CPU needs rather than as long as the frames take on air, and the same
+// seed always gives the same result.
+//
+// The writer and reader each tick on their own clock, which can be off from
+// nominal by a fixed ppm, and the writer's can drift. The channel holds the
+// writer's last level, and each read of it by the reader can be jittered in
+// time, flipped by noise (in short impulses, or in bursts), or lost in a
+// dropout, where the receiver hears nothing.
+//
+// The noise and dropouts come and go in time, not per read, so the same
+// channel can be run at any us_per_div. A slower link then has each impulse
+// hit fewer reads of a bit, but has longer frames for them to land in.
+//
+// Frames are sent back to back, each carrying its sequence number, so the
+// results count frames delivered intact, frames delivered but wrong (which
+// the FCS failed to catch), and the delay from ask_write() to delivery.
+//
+// ask_sim_arq_run() instead runs a reliable stream (ask_arq.hpp) over a
+// channel each way, with each end on its own clock.
+
+// Each of impulses, bursts and dropouts comes after a gap, and lasts for a
+// while, both drawn from an exponential distribution with the given mean in
+// us. A mean gap of 0 turns it off.
+struct ask_sim_channel {
+    // Impulse noise, which flips every read while it lasts.
+    double impulse_gap_us;
+    double impulse_us;
+    // Burst noise, as a two-state (Gilbert-Elliott) model, during which each
+    // read is flipped with burst_flip_probability.
+    double burst_gap_us;
+    double burst_us;
+    double burst_flip_probability;
+    // The receiver losing the signal. While it is lost, every read is low.
+    double dropout_gap_us;
+    double dropout_us;
+    // How far the writer's and reader's clocks are from nominal, and how
+    // fast the writer's wanders further off, in ppm per second.
+    double tx_ppm;
+    double rx_ppm;
+    double tx_drift_ppm_per_s;
+    // Each read happens up to this far either side of its tick. Must be
+    // under half a division.
+    uint32_t jitter_ns;
+};
+
+struct ask_sim_params {
+    uint32_t us_per_div;
+    uint32_t frames;
+    // At least 4, for the sequence number.
+    ask_len_t payload_bytes;
+    uint8_t preamble_max_errors;
+    struct ask_fec_params fec;
+    bool streaming;
+    uint32_t inter_frame_divs;
+    uint64_t seed;
+    struct ask_sim_channel channel;
+    enum ENCODING encoding;
+    // The reader takes v2 frames only if they are sent.
+    enum ASK_FRAME_FORMAT format;
+    // 0 for the reader to poll at us_per_div, like the writer. Otherwise it
+    // samples every sample_us, and detects the writer's rate from each
+    // preamble, taking any up to ASK_SIM_MAX_US_PER_DIV.
+    uint32_t sample_us;
+};
+
+#define ASK_SIM_MAX_US_PER_DIV 1000
+
+struct ask_sim_results {
+    uint32_t frames_sent;
+    uint32_t frames_ok;
+    // Delivered, but not what was sent.
+    uint32_t frames_corrupt;
+    double packet_error_rate;
+    // Intact payload bits per second of virtual time.
+    double goodput_bps;
+    double latency_mean_us;
+    double latency_max_us;
+    double simulated_s;
+    struct ask_reader_stats reader_stats;
+};
+
+// Something on the channel that comes and goes.
+struct ask_sim_process {
+    bool on;
+    double next_ns;
+};
+
+// One way over a channel, from a writer to a reader.
+struct ask_sim_link {
+    struct ask_sim_channel channel;
+    std::mt19937_64* rng;
+    // The level the writer is putting on the channel.
+    uint8_t line;
+    // Rather than a random draw on every read, the time at which each of
+    // these next changes is drawn as it changes.
+    struct ask_sim_process impulse;
+    struct ask_sim_process burst;
+    struct ask_sim_process dropout;
+};
+
+struct ask_sim {
+    struct ask_sim_params params;
+    std::mt19937_64 rng;
+    struct ask_sim_link link;
+    // What the reader reads payloads into, as on a real receiver.
+    struct ask_pool pool;
+    // The virtual time.
+    double now_ns;
+
+    std::vector<double> queued_ns;
+    std::vector<uint8_t> expected;
+    struct ask_sim_results results;
+    double latency_total_us;
+};
+
+// The writer, reader and channel callbacks take no context, so only one
+// simulation can run at a time on each thread.
+thread_local struct ask_sim* __ask_sim_active = NULL;
+
+// A uniform double in [0, 1), from the top 53 bits of the generator, which
+// unlike std::uniform_real_distribution is the same on every standard library.
+inline double __ask_sim_uniform(std::mt19937_64* rng)
+{
+    return ((*rng)() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// The payload of frame seq: its sequence number, then bytes that depend on it.
+void __ask_sim_payload(uint32_t seq, ask_len_t len, uint8_t* out)
+{
+    uint32_t x = seq * 2654435761u + 1;
+    memcpy(out, &seq, sizeof(seq));
+    for (ask_len_t i = sizeof(seq) ; i < len ; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        out[i] = x;
+    }
+}
+
+// A draw from an exponential distribution with the given mean.
+inline double __ask_sim_exponential(std::mt19937_64* rng, double mean)
+{
+    return -mean * log1p(-__ask_sim_uniform(rng));
+}
+
+void __ask_sim_process_init(struct ask_sim_process* process, std::mt19937_64* rng, double gap_us)
+{
+    process->on = false;
+    process->next_ns = (gap_us > 0 ? __ask_sim_exponential(rng, gap_us) * 1000 : INFINITY);
+}
+
+// Whether the process is on at now_ns, which never goes backwards.
+bool __ask_sim_process_at(struct ask_sim_process* process, std::mt19937_64* rng, double gap_us, double on_us,
+    double now_ns)
+{
+    while (process->next_ns <= now_ns)
+    {
+        process->on = !process->on;
+        process->next_ns += __ask_sim_exponential(rng, process->on ? on_us : gap_us) * 1000;
+    }
+    return process->on;
+}
+
+void __ask_sim_link_init(struct ask_sim_link* link, struct ask_sim_channel channel, std::mt19937_64* rng)
+{
+    link->channel = channel;
+    link->rng = rng;
+    link->line = 0;
+    __ask_sim_process_init(&link->impulse, rng, channel.impulse_gap_us);
+    __ask_sim_process_init(&link->burst, rng, channel.burst_gap_us);
+    __ask_sim_process_init(&link->dropout, rng, channel.dropout_gap_us);
+}
+
+// The level the reader sees at now_ns.
+uint8_t __ask_sim_link_read(struct ask_sim_link* link, double now_ns)
+{
+    struct ask_sim_channel* channel = &link->channel;
+
+    if (__ask_sim_process_at(&link->dropout, link->rng, channel->dropout_gap_us, channel->dropout_us, now_ns))
+    {
+        return 0;
+    }
+
+    uint8_t level = link->line;
+    if (__ask_sim_process_at(&link->impulse, link->rng, channel->impulse_gap_us, channel->impulse_us, now_ns))
+    {
+        level ^= 1;
+    }
+    if (__ask_sim_process_at(&link->burst, link->rng, channel->burst_gap_us, channel->burst_us, now_ns) &&
+        __ask_sim_uniform(link->rng) < channel->burst_flip_probability)
+    {
+        level ^= 1;
+    }
+    return level;
+}
+
+void __ask_sim_write(uint8_t level)
+{
+    __ask_sim_active->link.line = level;
+}
+
+uint8_t __ask_sim_read()
+{
+    return __ask_sim_link_read(&__ask_sim_active->link, __ask_sim_active->now_ns);
+}
+
+void __ask_sim_datagram(uint8_t* data, ask_len_t datalen)
+{
+    struct ask_sim* sim = __ask_sim_active;
+    if (data == NULL)
+    {
+        return;
+    }
+
+    uint32_t seq;
+    memcpy(&seq, data, sizeof(seq));
+    if (datalen != sim->params.payload_bytes || seq >= sim->results.frames_sent ||
+        sim->queued_ns[seq] < 0)
+    {
+        sim->results.frames_corrupt++;
+        ask_pool_return(&sim->pool, data);
+        return;
+    }
+
+    __ask_sim_payload(seq, datalen, sim->expected.data());
+    if (memcmp(data, sim->expected.data(), datalen) != 0)
+    {
+        sim->results.frames_corrupt++;
+        ask_pool_return(&sim->pool, data);
+        return;
+    }
+
+    double latency_us = (sim->now_ns - sim->queued_ns[seq]) / 1000;
+    sim->results.frames_ok++;
+    sim->latency_total_us += latency_us;
+    if (latency_us > sim->results.latency_max_us)
+    {
+        sim->results.latency_max_us = latency_us;
+    }
+    // Each frame is only counted once.
+    sim->queued_ns[seq] = -1;
+    ask_pool_return(&sim->pool, data);
+}
+
+struct ask_sim_results ask_sim_run(struct ask_sim_params params)
+{
+    struct ask_sim* sim = new struct ask_sim;
+    ask_len_t payload_onair = (ask_fec_enabled(&params.fec) ?
+        ask_fec_encoded_len(&params.fec, params.payload_bytes) : params.payload_bytes);
+    if (!ask_pool_init(&sim->pool, payload_onair, ASK_RX_QUEUE_DEPTH + 2))
+    {
+        fprintf(stderr, "Unable to allocate a pool for %d byte payloads\n", payload_onair);
+        ask_pool_free(&sim->pool);
+        delete sim;
+        return {};
+    }
+    sim->params = params;
+    sim->rng.seed(params.seed);
+    __ask_sim_link_init(&sim->link, params.channel, &sim->rng);
+    sim->now_ns = 0;
+    sim->queued_ns.assign(params.frames, -1);
+    sim->expected.resize(params.payload_bytes);
+    sim->results = {};
+    sim->latency_total_us = 0;
+    __ask_sim_active = sim;
+
+    struct ask_writer_params writer_params = {&__ask_sim_write, params.us_per_div,
+        params.streaming, params.inter_frame_divs, params.fec, params.encoding, params.format};
+    struct ask_writer writer = ask_writer_init(writer_params);
+    struct ask_reader_params reader_params = {&__ask_sim_read, &__ask_sim_datagram,
+        (params.sample_us != 0 ? params.sample_us : params.us_per_div), params.preamble_max_errors,
+        params.fec, &sim->pool, params.encoding, params.format == ASK_FRAME_V2,
+        (params.sample_us != 0 ? (uint32_t)ASK_SIM_MAX_US_PER_DIV : 0)};
+    struct ask_reader reader = ask_reader_init(reader_params);
+
+    const double div_ns = params.us_per_div * 1000.0;
+    const double sample_ns = reader_params.us_per_div * 1000.0;
+    const double rx_period_ns = sample_ns * (1 + params.channel.rx_ppm / 1e6);
+    double tx_tick_ns = 0;
+    double rx_nominal_ns = sample_ns / 2;
+    double rx_tick_ns = rx_nominal_ns;
+    // Once every frame is sent, enough time for the last one to be read.
+    double stop_ns = -1;
+    std::vector<uint8_t> payload(params.payload_bytes);
+
+    while (stop_ns < 0 || rx_tick_ns < stop_ns)
+    {
+        if (tx_tick_ns <= rx_tick_ns)
+        {
+            sim->now_ns = tx_tick_ns;
+
+            // Queue the next frame only once the last has gone out, so that
+            // its latency is airtime and decoding, not time spent queued.
+            if (sim->results.frames_sent < params.frames && ask_writer_flushed(&writer))
+            {
+                uint32_t seq = sim->results.frames_sent;
+                __ask_sim_payload(seq, params.payload_bytes, payload.data());
+                sim->queued_ns[seq] = sim->now_ns;
+                ask_write(&writer, payload.data(), params.payload_bytes, true);
+                sim->results.frames_sent++;
+            }
+            else if (stop_ns < 0 && sim->results.frames_sent == params.frames && ask_writer_flushed(&writer))
+            {
+                stop_ns = sim->now_ns + (16 + params.inter_frame_divs) * DIV_PER_BIT * div_ns;
+            }
+
+            ask_writer_callback(&writer);
+            double tx_ppm = params.channel.tx_ppm + params.channel.tx_drift_ppm_per_s * tx_tick_ns / 1e9;
+            tx_tick_ns += div_ns * (1 + tx_ppm / 1e6);
+        }
+        else
+        {
+            sim->now_ns = rx_tick_ns;
+            ask_reader_callback(&reader);
+            ask_reader_process(&reader);
+
+            rx_nominal_ns += rx_period_ns;
+            rx_tick_ns = rx_nominal_ns;
+            if (params.channel.jitter_ns > 0)
+            {
+                rx_tick_ns += (2 * __ask_sim_uniform(&sim->rng) - 1) * params.channel.jitter_ns;
+            }
+        }
+    }
+
+    struct ask_sim_results results = sim->results;
+    results.simulated_s = sim->now_ns / 1e9;
+    results.packet_error_rate = (results.frames_sent == 0 ? 0 :
+        1 - (double)results.frames_ok / results.frames_sent);
+    results.goodput_bps = results.frames_ok * params.payload_bytes * 8 / results.simulated_s;
+    results.latency_mean_us = (results.frames_ok == 0 ? 0 : sim->latency_total_us / results.frames_ok);
+    results.reader_stats = reader.stats;
+
+    // Any frame the reader was still part way through is in the pool.
+    ask_pool_free(&sim->pool);
+    __ask_sim_active = NULL;
+    delete sim;
+    return results;
+}
+
+struct ask_sim_arq_params {
+    uint32_t us_per_div;
+    uint32_t segments;
+    // At least 4, for the sequence number.
+    ask_len_t payload_bytes;
+    uint8_t window;
+    uint8_t preamble_max_errors;
+    struct ask_fec_params fec;
+    uint64_t seed;
+    // From the sender to the receiver, and back. The sender ticks on the
+    // nominal clock skewed by forward.tx_ppm, and the receiver by
+    // forward.rx_ppm, with its ticks jittered by forward.jitter_ns. The
+    // reverse channel's clock settings are unused.
+    struct ask_sim_channel forward;
+    struct ask_sim_channel reverse;
+};
+
+struct ask_sim_arq_results {
+    uint32_t segments_delivered;
+    // Delivered out of order, or not what was sent.
+    uint32_t segments_corrupt;
+    double goodput_bps;
+    // The goodput of the same payloads sent back to back over a perfect
+    // channel, with no ARQ at all.
+    double capacity_bps;
+    double latency_mean_us;
+    double simulated_s;
+    struct ask_arq_stats sender;
+    struct ask_arq_stats receiver;
+};
+
+struct ask_sim_arq {
+    struct ask_sim_arq_params params;
+    std::mt19937_64 rng;
+    struct ask_sim_link forward;
+    struct ask_sim_link reverse;
+    struct ask_arq sender;
+    struct ask_arq receiver;
+    struct ask_pool sender_pool;
+    struct ask_pool receiver_pool;
+    double now_ns;
+
+    std::vector<double> queued_ns;
+    std::vector<uint8_t> expected;
+    uint32_t next_seq;
+    struct ask_sim_arq_results results;
+    double latency_total_us;
+};
+
+thread_local struct ask_sim_arq* __ask_sim_arq_active = NULL;
+
+void __ask_sim_arq_forward_write(uint8_t level)
+{
+    __ask_sim_arq_active->forward.line = level;
+}
+
+uint8_t __ask_sim_arq_forward_read()
+{
+    return __ask_sim_link_read(&__ask_sim_arq_active->forward, __ask_sim_arq_active->now_ns);
+}
+
+void __ask_sim_arq_reverse_write(uint8_t level)
+{
+    __ask_sim_arq_active->reverse.line = level;
+}
+
+uint8_t __ask_sim_arq_reverse_read()
+{
+    return __ask_sim_link_read(&__ask_sim_arq_active->reverse, __ask_sim_arq_active->now_ns);
+}
+
+void __ask_sim_arq_sender_datagram(uint8_t* data, ask_len_t datalen)
+{
+    struct ask_sim_arq* sim = __ask_sim_arq_active;
+    ask_arq_receive(&sim->sender, data, datalen, (uint32_t)(sim->now_ns / 1000));
+    ask_pool_return(&sim->sender_pool, data);
+}
+
+void __ask_sim_arq_receiver_datagram(uint8_t* data, ask_len_t datalen)
+{
+    struct ask_sim_arq* sim = __ask_sim_arq_active;
+    ask_arq_receive(&sim->receiver, data, datalen, (uint32_t)(sim->now_ns / 1000));
+    ask_pool_return(&sim->receiver_pool, data);
+}
+
+void __ask_sim_arq_deliver(uint8_t* data, ask_len_t datalen)
+{
+    struct ask_sim_arq* sim = __ask_sim_arq_active;
+
+    uint32_t seq;
+    memcpy(&seq, data, sizeof(seq));
+    __ask_sim_payload(sim->next_seq, sim->params.payload_bytes, sim->expected.data());
+    if (datalen != sim->params.payload_bytes || seq != sim->next_seq ||
+        memcmp(data, sim->expected.data(), datalen) != 0)
+    {
+        sim->results.segments_corrupt++;
+        return;
+    }
+
+    sim->results.segments_delivered++;
+    sim->latency_total_us += (sim->now_ns - sim->queued_ns[seq]) / 1000;
+    sim->next_seq++;
+}
+
+struct ask_sim_arq_results ask_sim_arq_run(struct ask_sim_arq_params params)
+{
+    struct ask_sim_arq* sim = new struct ask_sim_arq;
+    sim->params = params;
+    sim->rng.seed(params.seed);
+    __ask_sim_link_init(&sim->forward, params.forward, &sim->rng);
+    __ask_sim_link_init(&sim->reverse, params.reverse, &sim->rng);
+    sim->now_ns = 0;
+    sim->queued_ns.assign(params.segments, -1);
+    sim->expected.resize(params.payload_bytes);
+    sim->next_seq = 0;
+    sim->results = {};
+    sim->latency_total_us = 0;
+
+    // The round trip is at least a segment and an ACK on air.
+    ask_len_t data_bytes = ASK_ARQ_DATA_HEADER + params.payload_bytes;
+    ask_len_t ack_bytes = ASK_ARQ_ACK_BYTES;
+    if (ask_fec_enabled(&params.fec))
+    {
+        data_bytes = ask_fec_encoded_len(&params.fec, data_bytes);
+        ack_bytes = ask_fec_encoded_len(&params.fec, ack_bytes);
+    }
+    uint32_t round_trip_us = (ask_frame_divisions(data_bytes, BALANCED_REPEATED, ASK_FRAME_V2) +
+        ask_frame_divisions(ack_bytes, BALANCED_REPEATED, ASK_FRAME_V2) + 2 * DIV_PER_BIT) * params.us_per_div;
+
+    // Nothing longer than a segment is ever sent either way.
+    bool pooled = ask_pool_init(&sim->sender_pool, data_bytes, ASK_RX_QUEUE_DEPTH + 2);
+    pooled = ask_pool_init(&sim->receiver_pool, data_bytes, ASK_RX_QUEUE_DEPTH + 2) && pooled;
+    if (!pooled)
+    {
+        fprintf(stderr, "Unable to allocate pools for %d byte segments\n", data_bytes);
+        ask_pool_free(&sim->sender_pool);
+        ask_pool_free(&sim->receiver_pool);
+        delete sim;
+        return {};
+    }
+    __ask_sim_arq_active = sim;
+
+    struct ask_writer_params sender_writer_params = {&__ask_sim_arq_forward_write, params.us_per_div,
+        true, DIV_PER_BIT, params.fec, BALANCED_REPEATED, ASK_FRAME_V2};
+    struct ask_writer sender_writer = ask_writer_init(sender_writer_params);
+    struct ask_reader_params sender_reader_params = {&__ask_sim_arq_reverse_read, &__ask_sim_arq_sender_datagram,
+        params.us_per_div, params.preamble_max_errors, params.fec, &sim->sender_pool, BALANCED_REPEATED, true, 0};
+    struct ask_reader sender_reader = ask_reader_init(sender_reader_params);
+
+    struct ask_writer_params receiver_writer_params = {&__ask_sim_arq_reverse_write, params.us_per_div,
+        true, DIV_PER_BIT, params.fec, BALANCED_REPEATED, ASK_FRAME_V2};
+    struct ask_writer receiver_writer = ask_writer_init(receiver_writer_params);
+    struct ask_reader_params receiver_reader_params = {&__ask_sim_arq_forward_read, &__ask_sim_arq_receiver_datagram,
+        params.us_per_div, params.preamble_max_errors, params.fec, &sim->receiver_pool, BALANCED_REPEATED, true, 0};
+    struct ask_reader receiver_reader = ask_reader_init(receiver_reader_params);
+
+    struct ask_arq_params arq_params = {params.window, params.payload_bytes,
+        4 * round_trip_us, round_trip_us, 64 * round_trip_us, &__ask_sim_arq_deliver};
+    bool started = ask_arq_init(&sim->sender, &sender_writer, arq_params);
+    started = ask_arq_init(&sim->receiver, &receiver_writer, arq_params) && started;
+    if (!started)
+    {
+        ask_arq_free(&sim->sender);
+        ask_arq_free(&sim->receiver);
+        ask_pool_free(&sim->sender_pool);
+        ask_pool_free(&sim->receiver_pool);
+        __ask_sim_arq_active = NULL;
+        delete sim;
+        return {};
+    }
+
+    const double div_ns = params.us_per_div * 1000.0;
+    const double rx_period_ns = div_ns * (1 + params.forward.rx_ppm / 1e6);
+    double tx_tick_ns = 0;
+    double rx_nominal_ns = div_ns / 2;
+    double rx_tick_ns = rx_nominal_ns;
+    // Give up on a channel so bad that the stream can't finish.
+    const double stop_ns = 100.0 * params.segments * round_trip_us * 1000;
+    uint32_t queued = 0;
+    std::vector<uint8_t> payload(params.payload_bytes);
+
+    while (sim->results.segments_delivered < params.segments && sim->now_ns < stop_ns)
+    {
+        if (tx_tick_ns <= rx_tick_ns)
+        {
+            sim->now_ns = tx_tick_ns;
+            uint32_t now_us = (uint32_t)(sim->now_ns / 1000);
+
+            // Keep the window full.
+            while (queued < params.segments && ask_arq_in_flight(&sim->sender) < params.window)
+            {
+                __ask_sim_payload(queued, params.payload_bytes, payload.data());
+                if (ask_arq_send(&sim->sender, payload.data(), params.payload_bytes, now_us) < 0)
+                {
+                    break;
+                }
+                sim->queued_ns[queued++] = sim->now_ns;
+            }
+
+            ask_arq_poll(&sim->sender, now_us);
+            ask_writer_callback(&sender_writer);
+            ask_reader_callback(&sender_reader);
+            ask_reader_process(&sender_reader);
+
+            double tx_ppm = params.forward.tx_ppm + params.forward.tx_drift_ppm_per_s * tx_tick_ns / 1e9;
+            tx_tick_ns += div_ns * (1 + tx_ppm / 1e6);
+        }
+        else
+        {
+            sim->now_ns = rx_tick_ns;
+            ask_arq_poll(&sim->receiver, (uint32_t)(sim->now_ns / 1000));
+            ask_writer_callback(&receiver_writer);
+            ask_reader_callback(&receiver_reader);
+            ask_reader_process(&receiver_reader);
+
+            rx_nominal_ns += rx_period_ns;
+            rx_tick_ns = rx_nominal_ns;
+            if (params.forward.jitter_ns > 0)
+            {
+                rx_tick_ns += (2 * __ask_sim_uniform(&sim->rng) - 1) * params.forward.jitter_ns;
+            }
+        }
+    }
+
+    // The writers read the ARQ's buffers until they are done.
+    while (!ask_writer_flushed(&sender_writer) || !ask_writer_flushed(&receiver_writer))
+    {
+        ask_writer_callback(&sender_writer);
+        ask_writer_callback(&receiver_writer);
+    }
+
+    struct ask_sim_arq_results results = sim->results;
+    results.simulated_s = sim->now_ns / 1e9;
+    results.goodput_bps = results.segments_delivered * params.payload_bytes * 8 / results.simulated_s;
+    ask_len_t payload_onair = (ask_fec_enabled(&params.fec) ?
+        ask_fec_encoded_len(&params.fec, params.payload_bytes) : params.payload_bytes);
+    results.capacity_bps = params.payload_bytes * 8 * 1e6 /
+        ((ask_frame_divisions(payload_onair, BALANCED_REPEATED, ASK_FRAME_V2) + DIV_PER_BIT) * (double)params.us_per_div);
+    results.latency_mean_us = (results.segments_delivered == 0 ? 0 : sim->latency_total_us / results.segments_delivered);
+    results.sender = sim->sender.stats;
+    results.receiver = sim->receiver.stats;
+
+    ask_arq_free(&sim->sender);
+    ask_arq_free(&sim->receiver);
+    // Any frames the readers were still part way through are in the pools.
+    ask_pool_free(&sim->sender_pool);
+    ask_pool_free(&sim->receiver_pool);
+    __ask_sim_arq_active = NULL;
+    delete sim;
+    return results;
+}
+
+#endif
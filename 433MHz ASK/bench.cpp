@@ -0,0 +1,886 @@
+// Host micro-benchmarks for the hot paths in ask.hpp.
+//
+// Build and run on the host with:
+//   g++ -O2 -std=c++17 -DASK_TRACE=0 bench.cpp -o bench -lpthread && ./bench [--csv]
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "ask.hpp"
+#include "ask_codec.hpp"
+#include "ask_batch.hpp"
+#include "ask_aggregate.hpp"
+
+#define BENCH_PULSES (1 << 22)
+
+// The preamble scan as it was before the sliding correlator: a 256 pulse
+// shift register, fully re-decoded on every tick.
+struct legacy_preamble_state {
+    uint64_t frame_preamble_pulses[sizeof(preamble_t)];
+};
+
+preamble_t legacy_pulses_to_bytes(uint8_t* bytes, ask_len_t num_bytes)
+{
+    uint64_t output = 0;
+
+    for (int i = 0 ; i < 8 * num_bytes ; i++)
+    {
+        output += ((uint64_t)(ONES_PER_BYTE[bytes[i]] >= 6) << i);
+    }
+
+    return output;
+}
+
+bool legacy_read_preamble(struct legacy_preamble_state* state, uint8_t pulse)
+{
+    uint8_t overflow = pulse;
+    uint8_t incoming = pulse;
+    for (size_t i = 0 ; i < sizeof(preamble_t) ; i++)
+    {
+        uint64_t v = state->frame_preamble_pulses[i];
+        overflow = v >> 63;
+        v <<= 1;
+        v += incoming;
+        incoming = overflow;
+        state->frame_preamble_pulses[i] = v;
+    }
+
+    return legacy_pulses_to_bytes((uint8_t*)state->frame_preamble_pulses, sizeof(preamble_t)) == FRAME_PREAMBLE;
+}
+
+uint8_t bench_read()
+{
+    return 0;
+}
+
+void bench_datagram(uint8_t* data, ask_len_t datalen)
+{
+}
+
+std::vector<uint8_t> bench_pulses(size_t n, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> pulses(n);
+    for (size_t i = 0 ; i < n ; i++)
+    {
+        pulses[i] = rng() & 1;
+    }
+    return pulses;
+}
+
+template <class callable>
+double bench_ns_per_op(size_t ops, callable&& f)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+void bench_preamble_scan()
+{
+    std::vector<uint8_t> pulses = bench_pulses(BENCH_PULSES, 1);
+    volatile uint32_t matches = 0;
+
+    double legacy_ns = bench_ns_per_op(pulses.size(), [&]() {
+        struct legacy_preamble_state state = {{0, 0, 0, 0}};
+        for (size_t i = 0 ; i < pulses.size() ; i++)
+        {
+            matches += legacy_read_preamble(&state, pulses[i]);
+        }
+    });
+
+    struct ask_reader_params params;
+    params.read = &bench_read;
+    params.datagram_ready = &bench_datagram;
+    params.us_per_div = 50;
+    params.preamble_max_errors = 0;
+    params.fec = {0, 0};
+    params.pool = NULL;
+    params.encoding = BALANCED_REPEATED;
+    params.accept_v2 = false;
+    params.max_us_per_div = 0;
+    struct ask_reader reader = ask_reader_init(params);
+
+    double correlator_ns = bench_ns_per_op(pulses.size(), [&]() {
+        for (size_t i = 0 ; i < pulses.size() ; i++)
+        {
+            ask_read_preamble(&reader, pulses[i]);
+            matches += (reader.stage == PREAMBLE_SCAN_COMPLETE);
+            reader.stage = PREAMBLE_SCAN;
+        }
+    });
+
+    printf("preamble_scan legacy     %8.2f ns/tick\n", legacy_ns);
+    printf("preamble_scan correlator %8.2f ns/tick\n", correlator_ns);
+}
+
+void bench_symbol_decode()
+{
+    std::vector<uint8_t> pulses = bench_pulses(BENCH_PULSES, 2);
+    volatile uint32_t nybbles = 0;
+    struct ask_symbol_read_state state;
+    __ask_symbol_state_sync(&state, 0);
+
+    double symbol_ns = bench_ns_per_op(pulses.size(), [&]() {
+        for (size_t i = 0 ; i < pulses.size() ; i++)
+        {
+            __ask_read_pulse(&state, pulses[i]);
+            uint8_t nybble = __ask_process_symbol(&state);
+            if (nybble != 0xff)
+            {
+                nybbles += nybble;
+                __ask_symbol_state_reset(&state);
+            }
+        }
+    });
+
+    printf("symbol_decode            %8.2f ns/tick\n", symbol_ns);
+}
+
+// The cost of listening to a quiet channel for a second at 50us per
+// division, polled every division, and driven by edges with a 10ms poll.
+void bench_idle_channel()
+{
+    const uint32_t us_per_div = 50;
+    const uint32_t seconds = 10;
+    const uint32_t divs_per_second = 1000000 / us_per_div;
+
+    struct ask_reader_params params;
+    params.read = &bench_read;
+    params.datagram_ready = &bench_datagram;
+    params.us_per_div = us_per_div;
+    params.preamble_max_errors = 0;
+    params.fec = {0, 0};
+    params.pool = NULL;
+    params.encoding = BALANCED_REPEATED;
+    params.accept_v2 = false;
+    params.max_us_per_div = 0;
+
+    struct ask_reader polled = ask_reader_init(params);
+    double polled_ns = bench_ns_per_op(seconds, [&]() {
+        for (uint32_t i = 0 ; i < seconds * divs_per_second ; i++)
+        {
+            ask_reader_callback(&polled);
+        }
+    });
+
+    struct ask_reader edged = ask_reader_init(params);
+    ask_reader_edge(&edged, 0, 0);
+    double edge_ns = bench_ns_per_op(seconds, [&]() {
+        for (uint32_t t = 0 ; t < seconds * 1000000 ; t += 10000)
+        {
+            ask_reader_edge_poll(&edged, t);
+        }
+    });
+
+    printf("idle_channel polled      %8.0f ns/s\n", polled_ns);
+    printf("idle_channel edge        %8.0f ns/s\n", edge_ns);
+}
+
+std::vector<uint8_t>* bench_replay;
+size_t bench_replay_index;
+
+uint8_t bench_replay_read()
+{
+    uint8_t pulse = (*bench_replay)[bench_replay_index];
+    bench_replay_index = (bench_replay_index + 1) % bench_replay->size();
+    return pulse;
+}
+
+void bench_codec_datagram(uint8_t* data, ask_len_t datalen)
+{
+    if (data != NULL)
+    {
+        free(data);
+    }
+}
+
+// Encoding and decoding a 200 byte frame with the runtime-configured
+// functions in ask.hpp, and with the equivalent compile-time AskCodec.
+void bench_codec()
+{
+    typedef AskCodec<DIV_PER_BIT, 6> codec;
+    const int frames = 2000;
+    std::vector<uint8_t> payload = bench_pulses(200, 3);
+
+    struct ask_writer_params writer_params = {NULL, 50, false, 0, {0, 0}, BALANCED_REPEATED, ASK_FRAME_V1};
+    struct ask_writer writer = ask_writer_init(writer_params);
+    struct ask_frame frame = ask_encap_payload(&writer, payload.data(), payload.size());
+    ask_len_t num_bits;
+
+    double runtime_encode_ns = bench_ns_per_op(frames, [&]() {
+        for (int i = 0 ; i < frames ; i++)
+        {
+            free(ask_encode_frame(&writer, &frame, &num_bits));
+        }
+    });
+
+    double codec_encode_ns = bench_ns_per_op(frames, [&]() {
+        for (int i = 0 ; i < frames ; i++)
+        {
+            free(codec::encode_frame(payload.data(), payload.size(), &num_bits));
+        }
+    });
+
+    ask_pulse_word_t* bit_stream = codec::encode_frame(payload.data(), payload.size(), &num_bits);
+    std::vector<uint8_t> pulses(num_bits);
+    for (ask_len_t i = 0 ; i < num_bits ; i++)
+    {
+        pulses[i] = (bit_stream[i / ASK_PULSES_PER_WORD] >> (i % ASK_PULSES_PER_WORD)) & 1;
+    }
+    free(bit_stream);
+
+    bench_replay = &pulses;
+    bench_replay_index = 0;
+    struct ask_reader_params reader_params;
+    reader_params.read = &bench_replay_read;
+    reader_params.datagram_ready = &bench_codec_datagram;
+    reader_params.us_per_div = 50;
+    reader_params.preamble_max_errors = 0;
+    reader_params.fec = {0, 0};
+    reader_params.pool = NULL;
+    reader_params.encoding = BALANCED_REPEATED;
+    reader_params.accept_v2 = false;
+    reader_params.max_us_per_div = 0;
+    struct ask_reader runtime_reader = ask_reader_init(reader_params);
+
+    double runtime_decode_ns = bench_ns_per_op(frames * pulses.size(), [&]() {
+        for (int i = 0 ; i < frames ; i++)
+        {
+            for (size_t p = 0 ; p < pulses.size() ; p++)
+            {
+                ask_reader_callback(&runtime_reader);
+            }
+            ask_reader_process(&runtime_reader);
+        }
+    });
+    // The last frame is only handed off at the pulse after it, as
+    // ask_capture_replay() does.
+    if (runtime_reader.stage == FCS_READ_COMPLETE)
+    {
+        ask_reader_callback(&runtime_reader);
+        ask_reader_process(&runtime_reader);
+    }
+
+    struct codec::reader_params codec_params = {&bench_codec_datagram, 0, 0};
+    struct codec::reader reader = codec::reader_init(codec_params);
+    double codec_decode_ns = bench_ns_per_op(frames * pulses.size(), [&]() {
+        for (int i = 0 ; i < frames ; i++)
+        {
+            for (size_t p = 0 ; p < pulses.size() ; p++)
+            {
+                codec::read(&reader, pulses[p]);
+            }
+        }
+    });
+
+    printf("encode_frame runtime     %8.0f ns/frame\n", runtime_encode_ns);
+    printf("encode_frame codec       %8.0f ns/frame\n", codec_encode_ns);
+    printf("decode runtime           %8.2f ns/tick (%u frames ok)\n", runtime_decode_ns, runtime_reader.stats.frames_ok);
+    printf("decode codec             %8.2f ns/tick (%u frames ok)\n", codec_decode_ns, reader.stats.frames_ok);
+}
+
+// The FCS over a 1kB payload, in whichever flavour ASK_FCS selects, with
+// slice-by-4 and one byte at a time as the reader does it.
+void bench_fcs()
+{
+    const int rounds = 20000;
+    std::vector<uint8_t> payload = bench_pulses(1024, 4);
+    volatile checksum_t sink = 0;
+
+    double sliced_ns = bench_ns_per_op(rounds * payload.size(), [&]() {
+        for (int i = 0 ; i < rounds ; i++)
+        {
+            sink = sink + __ask_fcs_update(ASK_FCS_INIT, payload.data(), payload.size());
+        }
+    });
+
+    double bytewise_ns = bench_ns_per_op(rounds * payload.size(), [&]() {
+        for (int i = 0 ; i < rounds ; i++)
+        {
+            checksum_t fcs = ASK_FCS_INIT;
+            for (size_t b = payload.size() ; b > 0 ; b--)
+            {
+                fcs = __ask_fcs_update_byte(fcs, payload[b - 1]);
+            }
+            sink = sink + fcs;
+        }
+    });
+
+    printf("fcs (ASK_FCS=%d) sliced   %7.2f ns/byte\n", ASK_FCS, sliced_ns);
+    printf("fcs (ASK_FCS=%d) bytewise %7.2f ns/byte\n", ASK_FCS, bytewise_ns);
+}
+
+// A loopback channel that flips whole symbol bits (all DIV_PER_BIT
+// divisions of one) at random with probability bench_ber.
+std::mt19937 bench_channel_rng(5);
+double bench_ber;
+uint8_t bench_channel_level;
+uint32_t bench_channel_divs;
+bool bench_channel_flip;
+std::vector<uint8_t>* bench_goodput_payload;
+uint32_t bench_goodput_ok;
+
+void bench_channel_write(uint8_t pulse)
+{
+    bench_channel_level = pulse;
+}
+
+uint8_t bench_channel_read()
+{
+    if (bench_channel_divs % DIV_PER_BIT == 0)
+    {
+        bench_channel_flip = std::uniform_real_distribution<double>(0, 1)(bench_channel_rng) < bench_ber;
+    }
+    bench_channel_divs++;
+    return bench_channel_level ^ bench_channel_flip;
+}
+
+void bench_goodput_datagram(uint8_t* data, ask_len_t datalen)
+{
+    if (data == NULL)
+    {
+        return;
+    }
+    if ((size_t)datalen == bench_goodput_payload->size() &&
+        memcmp(data, bench_goodput_payload->data(), datalen) == 0)
+    {
+        bench_goodput_ok++;
+    }
+    free(data);
+}
+
+// Goodput of 64 byte payloads at 50us per division against the bit error
+// rate, with FEC off and at a few parity and block sizes. Only frames that
+// come out intact count, and the time includes the FEC parity on air.
+void bench_fec_goodput()
+{
+    const int frames = 200;
+    const uint32_t us_per_div = 50;
+    const double bers[] = {0, 0.0005, 0.001, 0.002, 0.005, 0.01};
+    const struct ask_fec_params settings[] = {{0, 0}, {4, 32}, {8, 64}, {16, 64}};
+    std::vector<uint8_t> payload = bench_pulses(64, 6);
+    bench_goodput_payload = &payload;
+
+    printf("fec_goodput (kbit/s)     ber:");
+    for (double ber : bers)
+    {
+        printf(" %7.4f", ber);
+    }
+    printf("\n");
+
+    for (const struct ask_fec_params& fec : settings)
+    {
+        std::vector<double> kbps;
+        for (double ber : bers)
+        {
+            struct ask_writer_params writer_params = {&bench_channel_write, us_per_div, true, 0, fec,
+                BALANCED_REPEATED, ASK_FRAME_V1};
+            struct ask_writer writer = ask_writer_init(writer_params);
+            struct ask_reader_params reader_params = {&bench_channel_read, &bench_goodput_datagram, us_per_div, 2, fec,
+                NULL, BALANCED_REPEATED, false, 0};
+            struct ask_reader reader = ask_reader_init(reader_params);
+
+            bench_ber = ber;
+            bench_channel_level = 0;
+            bench_goodput_ok = 0;
+            uint64_t divs = 0;
+            for (int i = 0 ; i < frames ; i++)
+            {
+                ask_write(&writer, payload.data(), payload.size(), true);
+                while (!ask_writer_flushed(&writer))
+                {
+                    ask_writer_callback(&writer);
+                    ask_reader_callback(&reader);
+                    ask_reader_process(&reader);
+                    divs++;
+                }
+
+                // Let the reader give up on a frame whose length was hit.
+                for (uint32_t d = 0 ; d < 8 * DIV_PER_BIT ; d++)
+                {
+                    bench_channel_level = 0;
+                    ask_reader_callback(&reader);
+                    ask_reader_process(&reader);
+                    divs++;
+                }
+                if (reader.stage != PREAMBLE_SCAN)
+                {
+                    free(reader.frame.data);
+                    free(reader.frame.erasures);
+                    reader = ask_reader_init(reader_params);
+                }
+            }
+
+            double seconds = divs * us_per_div / 1e6;
+            kbps.push_back(bench_goodput_ok * payload.size() * 8 / seconds / 1000);
+        }
+
+        printf("fec_goodput parity %2u/%3u    ", fec.parity_bytes, fec.block_bytes);
+        for (double k : kbps)
+        {
+            printf(" %7.2f", k);
+        }
+        printf("\n");
+    }
+}
+
+std::vector<uint8_t>* bench_capture;
+
+void bench_capture_write(uint8_t pulse)
+{
+    bench_capture->push_back(pulse);
+}
+
+uint32_t bench_batch_frames;
+
+void bench_batch_frame(size_t offset, uint8_t* data, ask_len_t datalen)
+{
+    bench_batch_frames++;
+    free(data);
+}
+
+// Decoding a capture of 100 frames spread over a line that is mostly idle
+// and noisy, with the polled reader, and with ask_decode_buffer().
+void bench_batch_decode()
+{
+    std::mt19937 rng(7);
+    std::vector<uint8_t> capture;
+    bench_capture = &capture;
+
+    struct ask_writer_params writer_params = {&bench_capture_write, 50, false, 0, {0, 0}, BALANCED_REPEATED, ASK_FRAME_V1};
+    struct ask_writer writer = ask_writer_init(writer_params);
+    std::vector<uint8_t> payload = bench_pulses(64, 8);
+    for (int i = 0 ; i < 100 ; i++)
+    {
+        // An unsquelched receiver puts out random noise between frames.
+        for (int d = 0 ; d < 200000 ; d++)
+        {
+            capture.push_back(rng() & 1);
+        }
+        ask_write(&writer, payload.data(), payload.size(), true);
+        while (!ask_writer_flushed(&writer))
+        {
+            ask_writer_callback(&writer);
+        }
+    }
+    capture.resize(capture.size() + 8 * DIV_PER_BIT, 0);
+
+    bench_replay = &capture;
+    bench_replay_index = 0;
+    struct ask_reader_params reader_params = {&bench_replay_read, &bench_codec_datagram, 50, 2, {0, 0},
+        NULL, BALANCED_REPEATED, false, 0};
+    struct ask_reader reader = ask_reader_init(reader_params);
+    double polled_ns = bench_ns_per_op(capture.size(), [&]() {
+        for (size_t i = 0 ; i < capture.size() ; i++)
+        {
+            ask_reader_callback(&reader);
+            ask_reader_process(&reader);
+        }
+    });
+
+    struct ask_batch_params batch_params = {2, {0, 0}, 0, &bench_batch_frame, BALANCED_REPEATED};
+    bench_batch_frames = 0;
+    double batch_ns = bench_ns_per_op(capture.size(), [&]() {
+        ask_decode_buffer(capture.data(), capture.size(), batch_params);
+    });
+
+    printf("capture polled           %8.2f ns/sample (%u frames ok)\n", polled_ns, reader.stats.frames_ok);
+    printf("capture batch            %8.2f ns/sample (%u frames ok, %u threads)\n", batch_ns,
+        bench_batch_frames, std::thread::hardware_concurrency());
+}
+
+// The payload sizes the per-frame hot paths are timed at. Each is timed over
+// enough frames to make up about BENCH_PULSES divisions, and the best of
+// BENCH_REPEATS runs is kept, to leave out whatever else the host was doing.
+static const ask_len_t BENCH_PAYLOAD_SIZES[] = {1, 16, 64, 256, 1024};
+#define BENCH_REPEATS 5
+
+template <class callable>
+double bench_best_ns_per_op(size_t ops, callable&& f)
+{
+    double best = bench_ns_per_op(ops, f);
+    for (int i = 1 ; i < BENCH_REPEATS ; i++)
+    {
+        double ns = bench_ns_per_op(ops, f);
+        best = (ns < best ? ns : best);
+    }
+    return best;
+}
+
+void bench_sink(uint8_t pulse)
+{
+}
+
+struct ask_pool* bench_pool;
+
+void bench_pool_datagram(uint8_t* data, ask_len_t datalen)
+{
+    ask_pool_return(bench_pool, data);
+}
+
+void bench_report(bool csv, const char* name, ask_len_t payload_bytes, double ns_per_frame)
+{
+    ask_len_t divs = ask_frame_divisions(payload_bytes);
+    if (csv)
+    {
+        printf("%s,%d,%d,%.1f,%.3f\n", name, payload_bytes, divs, ns_per_frame, ns_per_frame / divs);
+    }
+    else
+    {
+        printf("%-16s %5d B %10.0f ns/frame %7.2f ns/div\n", name, payload_bytes, ns_per_frame, ns_per_frame / divs);
+    }
+}
+
+// Encoding, sending and decoding whole frames of each payload size, per
+// frame and per division on air. With csv set, only these are printed, as
+// CSV, so that builds can be compared for regressions.
+void bench_payload_sizes(bool csv)
+{
+    if (csv)
+    {
+        printf("name,payload_bytes,divs_per_frame,ns_per_frame,ns_per_div\n");
+    }
+
+    for (ask_len_t payload_bytes : BENCH_PAYLOAD_SIZES)
+    {
+        std::vector<uint8_t> payload = bench_pulses(payload_bytes, 9);
+        const ask_len_t divs = ask_frame_divisions(payload_bytes);
+        const int frames = (BENCH_PULSES + divs - 1) / divs;
+        volatile checksum_t sink = 0;
+
+        struct ask_writer_params writer_params = {&bench_sink, 50, false, 0, {0, 0}, BALANCED_REPEATED, ASK_FRAME_V1};
+        struct ask_writer writer = ask_writer_init(writer_params);
+        struct ask_frame frame = ask_encap_payload(&writer, payload.data(), payload_bytes);
+        ask_len_t num_bits;
+
+        bench_report(csv, "fcs_calculate", payload_bytes, bench_best_ns_per_op(frames, [&]() {
+            for (int i = 0 ; i < frames ; i++)
+            {
+                sink = sink + __ask_fcs_calculate(&frame);
+            }
+        }));
+
+        bench_report(csv, "encode_frame", payload_bytes, bench_best_ns_per_op(frames, [&]() {
+            for (int i = 0 ; i < frames ; i++)
+            {
+                free(ask_encode_frame(&writer, &frame, &num_bits));
+            }
+        }));
+
+        // ask_write() and then every ask_writer_callback() to send it.
+        bench_report(csv, "write", payload_bytes, bench_best_ns_per_op(frames, [&]() {
+            for (int i = 0 ; i < frames ; i++)
+            {
+                ask_write(&writer, payload.data(), payload_bytes, true);
+                while (!ask_writer_flushed(&writer))
+                {
+                    ask_writer_callback(&writer);
+                }
+            }
+        }));
+
+        writer_params.streaming = true;
+        struct ask_writer streaming_writer = ask_writer_init(writer_params);
+        bench_report(csv, "write_streaming", payload_bytes, bench_best_ns_per_op(frames, [&]() {
+            for (int i = 0 ; i < frames ; i++)
+            {
+                ask_write(&streaming_writer, payload.data(), payload_bytes, true);
+                while (!ask_writer_flushed(&streaming_writer))
+                {
+                    ask_writer_callback(&streaming_writer);
+                }
+            }
+        }));
+
+        ask_pulse_word_t* bit_stream = ask_encode_frame(&writer, &frame, &num_bits);
+        std::vector<uint8_t> pulses(num_bits);
+        for (ask_len_t i = 0 ; i < num_bits ; i++)
+        {
+            pulses[i] = (bit_stream[i / ASK_PULSES_PER_WORD] >> (i % ASK_PULSES_PER_WORD)) & 1;
+        }
+        free(bit_stream);
+
+        struct ask_reader_params reader_params = {&bench_replay_read, &bench_codec_datagram, 50, 0, {0, 0},
+            NULL, BALANCED_REPEATED, false, 0};
+        struct ask_reader scanner = ask_reader_init(reader_params);
+        bench_report(csv, "read_preamble", payload_bytes, bench_best_ns_per_op(frames, [&]() {
+            for (int i = 0 ; i < frames ; i++)
+            {
+                for (size_t p = 0 ; p < pulses.size() ; p++)
+                {
+                    ask_read_preamble(&scanner, pulses[p]);
+                    scanner.stage = PREAMBLE_SCAN;
+                }
+            }
+        }));
+
+        // The whole reader: preamble, symbols and FCS, with the frames
+        // back to back.
+        bench_replay = &pulses;
+        bench_replay_index = 0;
+        struct ask_reader reader = ask_reader_init(reader_params);
+        bench_report(csv, "decode", payload_bytes, bench_best_ns_per_op(frames, [&]() {
+            for (int i = 0 ; i < frames ; i++)
+            {
+                for (size_t p = 0 ; p < pulses.size() ; p++)
+                {
+                    ask_reader_callback(&reader);
+                }
+                ask_reader_process(&reader);
+            }
+        }));
+
+        // The last frame is only handed over on the pulse after it.
+        if (reader.stats.frames_ok < (uint32_t)(frames * BENCH_REPEATS - 1))
+        {
+            fprintf(stderr, "decode of %d byte payloads: only %u of %d frames ok\n",
+                payload_bytes, reader.stats.frames_ok, frames * BENCH_REPEATS);
+        }
+
+        // The same, reading into a pool rather than calling calloc().
+        struct ask_pool pool;
+        ask_pool_init(&pool, payload_bytes, ASK_RX_QUEUE_DEPTH + 1);
+        bench_pool = &pool;
+        reader_params.pool = &pool;
+        reader_params.datagram_ready = &bench_pool_datagram;
+        bench_replay_index = 0;
+        struct ask_reader pool_reader = ask_reader_init(reader_params);
+        bench_report(csv, "decode_pool", payload_bytes, bench_best_ns_per_op(frames, [&]() {
+            for (int i = 0 ; i < frames ; i++)
+            {
+                for (size_t p = 0 ; p < pulses.size() ; p++)
+                {
+                    ask_reader_callback(&pool_reader);
+                }
+                ask_reader_process(&pool_reader);
+            }
+        }));
+        ask_pool_free(&pool);
+    }
+}
+
+// Each line code, by airtime per payload byte, and the cost of decoding it,
+// per payload bit and per bit on the line. The reliability of each over a
+// given channel is for sim.cpp.
+void bench_encodings()
+{
+    const char* names[] = {"balanced (4b6b)", "unbalanced", "manchester"};
+    const ask_len_t payload_bytes = 64;
+    const uint32_t us_per_div = 50;
+    std::vector<uint8_t> payload = bench_pulses(payload_bytes, 10);
+
+    for (int e = BALANCED_REPEATED ; e <= MANCHESTER ; e++)
+    {
+        enum ENCODING encoding = (enum ENCODING)e;
+        struct ask_writer_params writer_params = {&bench_sink, us_per_div, false, 0, {0, 0}, encoding, ASK_FRAME_V1};
+        struct ask_writer writer = ask_writer_init(writer_params);
+        struct ask_frame frame = ask_encap_payload(&writer, payload.data(), payload_bytes);
+        ask_len_t num_bits;
+        ask_pulse_word_t* bit_stream = ask_encode_frame(&writer, &frame, &num_bits);
+        std::vector<uint8_t> pulses(num_bits);
+        for (ask_len_t i = 0 ; i < num_bits ; i++)
+        {
+            pulses[i] = (bit_stream[i / ASK_PULSES_PER_WORD] >> (i % ASK_PULSES_PER_WORD)) & 1;
+        }
+        free(bit_stream);
+
+        const int frames = BENCH_PULSES / num_bits + 1;
+        bench_replay = &pulses;
+        bench_replay_index = 0;
+        struct ask_reader_params reader_params = {&bench_replay_read, &bench_codec_datagram, us_per_div, 0, {0, 0},
+            NULL, encoding, false, 0};
+        struct ask_reader reader = ask_reader_init(reader_params);
+        double ns_per_frame = bench_best_ns_per_op(frames, [&]() {
+            for (int i = 0 ; i < frames ; i++)
+            {
+                for (size_t p = 0 ; p < pulses.size() ; p++)
+                {
+                    ask_reader_callback(&reader);
+                }
+                ask_reader_process(&reader);
+            }
+        });
+
+        ask_len_t divs_per_byte = ask_frame_divisions(payload_bytes + 1, encoding) - ask_frame_divisions(payload_bytes, encoding);
+        printf("encoding %-16s %4d divs/byte %6u us/byte %7.2f ns/payload bit %6.2f ns/line bit (%u frames ok)\n",
+            names[e], divs_per_byte, divs_per_byte * us_per_div, ns_per_frame / (payload_bytes * 8),
+            ns_per_frame * DIV_PER_BIT / num_bits, reader.stats.frames_ok);
+    }
+}
+
+// The air time of each frame format for short payloads, where the header is
+// most of the frame, and the cost of decoding a v2 frame.
+void bench_frame_formats()
+{
+    const ask_len_t sizes[] = {1, 8, 32, 63, 64, 256};
+    const uint32_t us_per_div = 50;
+
+    for (ask_len_t payload_bytes : sizes)
+    {
+        std::vector<uint8_t> payload = bench_pulses(payload_bytes, 11);
+        struct ask_writer_params writer_params = {&bench_sink, us_per_div, false, 0, {0, 0}, BALANCED_REPEATED, ASK_FRAME_V2};
+        struct ask_writer writer = ask_writer_init(writer_params);
+        struct ask_frame frame = ask_encap_payload(&writer, payload.data(), payload_bytes);
+        ask_len_t num_bits;
+        ask_pulse_word_t* bit_stream = ask_encode_frame(&writer, &frame, &num_bits);
+        std::vector<uint8_t> pulses(num_bits);
+        for (ask_len_t i = 0 ; i < num_bits ; i++)
+        {
+            pulses[i] = (bit_stream[i / ASK_PULSES_PER_WORD] >> (i % ASK_PULSES_PER_WORD)) & 1;
+        }
+        free(bit_stream);
+
+        const int frames = BENCH_PULSES / num_bits + 1;
+        bench_replay = &pulses;
+        bench_replay_index = 0;
+        struct ask_reader_params reader_params = {&bench_replay_read, &bench_codec_datagram, us_per_div, 0, {0, 0},
+            NULL, BALANCED_REPEATED, true, 0};
+        struct ask_reader reader = ask_reader_init(reader_params);
+        double ns_per_frame = bench_best_ns_per_op(frames, [&]() {
+            for (int i = 0 ; i < frames ; i++)
+            {
+                for (size_t p = 0 ; p < pulses.size() ; p++)
+                {
+                    ask_reader_callback(&reader);
+                }
+                ask_reader_process(&reader);
+            }
+        });
+
+        ask_len_t v1_divs = ask_frame_divisions(payload_bytes);
+        ask_len_t v2_divs = ask_frame_divisions(payload_bytes, BALANCED_REPEATED, ASK_FRAME_V2);
+        printf("frame format %4d byte payload: v1 %6d divs, v2 %6d divs (%4.1f%% shorter), v2 decode %9.1f ns/frame (%u frames ok)\n",
+            payload_bytes, v1_divs, v2_divs, 100.0 * (v1_divs - v2_divs) / v1_divs, ns_per_frame, reader.stats.frames_ok);
+    }
+}
+
+std::vector<uint32_t>* bench_aggregate_queued_us;
+uint32_t bench_aggregate_now_us;
+uint32_t bench_aggregate_ok;
+double bench_aggregate_latency_us;
+
+void bench_aggregate_datagram(uint8_t* data, ask_len_t datalen)
+{
+    if (data == NULL)
+    {
+        return;
+    }
+    uint32_t seq;
+    memcpy(&seq, data, sizeof(seq));
+    if (seq < bench_aggregate_queued_us->size())
+    {
+        bench_aggregate_ok++;
+        bench_aggregate_latency_us += bench_aggregate_now_us - (*bench_aggregate_queued_us)[seq];
+    }
+    free(data);
+}
+
+// Run 8 byte records offered at a steady rate through an aggregating writer
+// to a reader for a while, and print the goodput, the mean latency from
+// ask_aggregate_write() to delivery, and the share of the time on air.
+void bench_aggregate_run(uint32_t offered_per_second, uint8_t max_records, uint32_t max_delay_us)
+{
+    const uint32_t us_per_div = 50;
+    const uint32_t seconds = 30;
+    const ask_len_t record_bytes = 8;
+
+    struct ask_writer_params writer_params = {&bench_channel_write, us_per_div, true, DIV_PER_BIT, {0, 0},
+        BALANCED_REPEATED, ASK_FRAME_V2};
+    struct ask_writer writer = ask_writer_init(writer_params);
+    struct ask_aggregator aggregator;
+    ask_aggregator_init(&aggregator, &writer, {max_records, 256, max_delay_us});
+    struct ask_reader_params reader_params = {&bench_channel_read, &bench_aggregate_datagram, us_per_div, 2, {0, 0},
+        NULL, BALANCED_REPEATED, true, 0};
+    struct ask_reader reader = ask_reader_init(reader_params);
+
+    std::vector<uint32_t> queued_us;
+    bench_aggregate_queued_us = &queued_us;
+    bench_aggregate_ok = 0;
+    bench_aggregate_latency_us = 0;
+    bench_ber = 0;
+    bench_channel_level = 0;
+    uint8_t record[record_bytes] = {0};
+    uint32_t busy_divs = 0;
+    const uint32_t divs = seconds * 1000000 / us_per_div;
+    const uint32_t divs_per_record = 1000000 / us_per_div / offered_per_second;
+    for (uint32_t d = 0 ; d < divs ; d++)
+    {
+        bench_aggregate_now_us = d * us_per_div;
+        if (d % divs_per_record == 0)
+        {
+            uint32_t seq = queued_us.size();
+            memcpy(record, &seq, sizeof(seq));
+            if (ask_aggregate_write(&aggregator, record, record_bytes, bench_aggregate_now_us) >= 0)
+            {
+                queued_us.push_back(bench_aggregate_now_us);
+            }
+        }
+        ask_aggregator_poll(&aggregator, bench_aggregate_now_us);
+        busy_divs += writer.data_ready;
+        ask_writer_callback(&writer);
+        ask_reader_callback(&reader);
+        ask_reader_process(&reader);
+    }
+
+    printf("aggregate %4u/s offered, %2u records, wait %4u ms: goodput %5.2f kbit/s, latency %7.1f ms, %5.1f%% on air\n",
+        offered_per_second, max_records, max_delay_us / 1000,
+        bench_aggregate_ok * record_bytes * 8 / (double)seconds / 1000,
+        (bench_aggregate_ok == 0 ? 0 : bench_aggregate_latency_us / bench_aggregate_ok / 1000),
+        100.0 * busy_divs / divs);
+
+    // The writer reads the aggregator's buffers until it is done.
+    while (!ask_writer_flushed(&writer))
+    {
+        ask_writer_callback(&writer);
+    }
+    ask_aggregator_free(&aggregator);
+    if (reader.frame.data != NULL)
+    {
+        free(reader.frame.data);
+    }
+}
+
+// Goodput against batch size with records offered faster than the channel
+// can take them, then the latency and airtime of a light load as frames
+// are let fill for longer.
+void bench_aggregation()
+{
+    const uint8_t batch_sizes[] = {1, 2, 4, 8, 16, 32};
+    const uint32_t delays_us[] = {0, 100000, 500000, 2000000};
+
+    for (uint8_t max_records : batch_sizes)
+    {
+        bench_aggregate_run(1000, max_records, 500000);
+    }
+    for (uint32_t max_delay_us : delays_us)
+    {
+        bench_aggregate_run(10, 32, max_delay_us);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--csv") == 0)
+    {
+        bench_payload_sizes(true);
+        return 0;
+    }
+
+    bench_preamble_scan();
+    bench_symbol_decode();
+    bench_idle_channel();
+    bench_codec();
+    bench_fcs();
+    bench_fec_goodput();
+    bench_batch_decode();
+    bench_payload_sizes(false);
+    bench_encodings();
+    bench_frame_formats();
+    bench_aggregation();
+    return 0;
+}
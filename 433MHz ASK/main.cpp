@@ -9,6 +9,7 @@
 
 #include "ask.hpp"
 #include "repeater.hpp"
+#include "scheduler.hpp"
 
 #define US_PER_DIV 50
 
@@ -21,6 +22,7 @@
 
 volatile uint32_t successes = 0;
 volatile uint32_t channel = 0;
+struct ask_pool rx_pool;
 
 void bit_writer(uint8_t bit)
 {
@@ -40,8 +42,8 @@ void datagram(uint8_t* data, ask_len_t datalen)
     }
     else
     {
-        printf("DATAGRAM: %s\n", data);
-        free(data);
+        printf("DATAGRAM: %.*s\n", datalen, data);
+        ask_pool_return(&rx_pool, data);
         successes++;
     }
 }
@@ -68,29 +70,61 @@ int main(int argc, char** argv)
     // To construct the writer, we need to know:
     // - the callback to write a bit
     // - The number of microsecons per division, which controls the period of the timer.
+    // - Whether frames are pre-encoded, or generated division by division in the timer.
+    // - The idle gap between queued frames sent back-to-back.
+    // - The FEC and line code, which the reader must match.
+    // - The frame format, where v2 has less overhead for short payloads.
     struct ask_writer_params writer_params;
     writer_params.write = &bit_writer;
     writer_params.us_per_div = US_PER_DIV;
+    writer_params.streaming = false;
+    writer_params.inter_frame_divs = DIV_PER_BIT;
+    writer_params.fec = {0, 0};
+    writer_params.encoding = BALANCED_REPEATED;
+    writer_params.format = ASK_FRAME_V2;
     struct ask_writer writer = ask_writer_init(writer_params);
 
     // There is a manual post-initialization step to add the writer to
     // a strict timer process
     //
     // On a Pico, you'd call add_repeating_timer_us, but here we need
-    // to invoke the Repeater class to do this.
-    Repeater* rw = new Repeater(writer_params.us_per_div, true, false, &ask_writer_callback, &writer);
+    // to register it with a Scheduler, which runs every channel's timer
+    // callbacks from a single thread.
+    Scheduler scheduler;
+    size_t sw = scheduler.add(writer_params.us_per_div, &ask_writer_callback, &writer);
 
     // To construct the reader, we need to have one more parameter than
     // a writer:
     // - The callback to read a bit
     // - The callback when a datagram is ready for processing
     // - The time per division.
+    // - How many preamble bits may be corrupted before a frame is missed.
+    // - The pool of buffers to read payloads into, which bounds how long a
+    //   frame can be, and how much memory receiving can take.
+    // - The line code, and whether to take v2 frames as well as v1.
+    // - The slowest sender to detect the rate of, if any, in which case the
+    //   time per division is how often to sample, and the senders may each
+    //   use any rate down to max_us_per_div.
+    // datagram() gives each buffer straight back, so the pool only needs
+    // the reader's own, and the one being handed to datagram().
+    ask_pool_init(&rx_pool, 128, ASK_RX_QUEUE_DEPTH + 2);
     struct ask_reader_params reader_params;
     reader_params.read = &bit_reader;
     reader_params.datagram_ready = &datagram;
     reader_params.us_per_div = US_PER_DIV;
+    reader_params.preamble_max_errors = 2;
+    reader_params.fec = {0, 0};
+    reader_params.pool = &rx_pool;
+    reader_params.encoding = BALANCED_REPEATED;
+    reader_params.accept_v2 = true;
+    reader_params.max_us_per_div = 0;
     struct ask_reader reader = ask_reader_init(reader_params);
-    Repeater* rr = new Repeater(reader_params.us_per_div, true, false, &ask_reader_callback, &reader);
+    size_t sr = scheduler.add(reader_params.us_per_div, &ask_reader_callback, &reader);
+    scheduler.start(true);
+
+    // Frames read in by the timer are validated and delivered by a single
+    // long-lived consumer, off the sampling path.
+    Repeater* rp = new Repeater(1000, true, false, &ask_reader_process, &reader);
 
     uint8_t* data1 = (uint8_t*)"This is a test string\0This is a test string\0This is a test string\0This is a test string\0";
     uint32_t datalen = 22 * 4;
@@ -111,9 +145,12 @@ int main(int argc, char** argv)
     }
 
     fprintf(stderr, "%u %u\n", numsent / datalen, successes);
+    scheduler.print_stats(stderr, sw, "writer");
+    scheduler.print_stats(stderr, sr, "reader");
 
-    delete rr;
-    delete rw;
+    delete rp;
+    scheduler.stop();
+    ask_pool_free(&rx_pool);
 
     return 0;
 }
@@ -6,123 +6,344 @@
 #include <functional>
 #include <chrono>
 #include <future>
+#include <semaphore.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
+
+// What a fixed-rate Repeater does when it wakes up after one or more of its
+// deadlines have already passed.
+enum RepeaterMissedTick {
+    // Run the task once for every missed deadline, back-to-back, so the
+    // total number of ticks over time is preserved.
+    REPEATER_CATCH_UP,
+    // Run the task once, and move the deadline on to the next one that is
+    // still in the future, so the phase of the ticks is preserved.
+    REPEATER_SKIP
+};
+
+struct RepeaterTiming {
+    uint32_t us;
+    // Fixed-rate ticks are scheduled at start + n * us. Otherwise each tick
+    // is scheduled us after the previous one finished (fixed-delay).
+    bool fixed_rate = true;
+    RepeaterMissedTick missed_tick = REPEATER_CATCH_UP;
+    // The final stretch before each deadline that is busy-waited rather
+    // than slept, to absorb the OS wakeup latency.
+    uint32_t spin_us = 100;
+};
+
+// Histogram bucket 0 counts samples under 1us, and bucket i > 0 counts
+// samples in [2^(i-1), 2^i) us. The last bucket also takes everything larger.
+#define REPEATER_HISTOGRAM_BUCKETS 20
+
+struct RepeaterStats {
+    uint64_t ticks;
+    // How late each tick woke up relative to its deadline.
+    uint32_t lateness_us[REPEATER_HISTOGRAM_BUCKETS];
+    uint32_t max_lateness_us;
+    // How long the task ran for on the timer thread (with asynctask, this
+    // only covers handing the tick to the worker).
+    uint32_t duration_us[REPEATER_HISTOGRAM_BUCKETS];
+    uint32_t max_duration_us;
+    // Ticks that were still running when the next deadline came around, and
+    // the furthest past that deadline any of them finished.
+    uint32_t missed_deadlines;
+    uint32_t max_overrun_us;
+};
 
 class Repeater
 {
 public:
+    typedef std::chrono::steady_clock clock;
+
     volatile bool running = false;
     uint32_t us;
-    std::thread* async_thread;
+    struct RepeaterTiming timing;
+    std::thread* async_thread = NULL;
+
+    // Deadlines that were passed over entirely under REPEATER_SKIP.
+    volatile uint32_t skipped_ticks = 0;
+
+    // Updated by the timer thread on every tick, and read with stats_snapshot().
+    // stats_seq is odd while an update is in progress.
+    struct RepeaterStats stats = {};
+    std::atomic<uint32_t> stats_seq{0};
+
+    // With asynctask set, each tick is handed to a single long-lived worker
+    // thread rather than a freshly spawned one. At most max_pending ticks
+    // are queued up for it, and any beyond that are counted and dropped.
+    // The timer thread never takes a lock to hand a tick over: it claims a
+    // slot in worker_pending with a compare-exchange and posts worker_wake,
+    // which the worker waits on.
+    std::thread* worker_thread = NULL;
+    sem_t worker_wake;
+    std::atomic<uint32_t> worker_pending{0};
+    uint32_t max_pending = 4;
+    volatile uint32_t dropped_ticks = 0;
 
     template <class callable, class... arguments>
     Repeater(uint32_t us, bool async, bool asynctask, callable&& f, arguments&&... args)
-    {        
-        this->us = us;
+        : Repeater(RepeaterTiming{us}, async, asynctask,
+            std::forward<callable>(f), std::forward<arguments>(args)...)
+    {
+    }
+
+    template <class callable, class... arguments>
+    Repeater(struct RepeaterTiming timing, bool async, bool asynctask, callable&& f, arguments&&... args)
+    {
+        this->us = timing.us;
+        this->timing = timing;
         std::function<
             typename std::result_of<callable(arguments...)>::type()
             > task(
-                std::bind(std::forward<callable>(f), 
+                std::bind(std::forward<callable>(f),
                 std::forward<arguments>(args)...));
 
-        if (async)
+        if (asynctask)
         {
             this->running = true;
-            this->async_thread = new std::thread([us, task, asynctask, this]() {
-                auto us_dura = std::chrono::microseconds(us);
-                auto alarm = std::chrono::high_resolution_clock::now() + us_dura;
-
-                while(this->running)
+            sem_init(&this->worker_wake, 0, 0);
+            this->worker_thread = new std::thread([task, this]() {
+                while (true)
                 {
-                    std::chrono::microseconds sleep_dt = std::chrono::duration_cast<
-                        std::chrono::microseconds>(
-                            alarm - std::chrono::high_resolution_clock::now());
-
-                    if (us < 100000)
-                    {
-                        Repeater::spin_sleep_for(sleep_dt);
-                    }
-                    else
+                    while (sem_wait(&this->worker_wake) != 0)
                     {
-                        std::this_thread::sleep_for(sleep_dt);
+                        // Interrupted by a signal.
                     }
 
-                    if (asynctask)
+                    if (!this->running)
                     {
-                        std::thread* t = new std::thread(task);
-                        t->detach();
-                    }
-                    else
-                    {
-                        task();
+                        return;
                     }
+                    this->worker_pending.fetch_sub(1, std::memory_order_acq_rel);
 
-                    alarm += us_dura;
+                    task();
                 }
             });
-            this->async_thread->detach();
+        }
+
+        this->running = true;
+        if (async)
+        {
+            this->async_thread = new std::thread([task, asynctask, this]() {
+                this->run(task, asynctask);
+            });
         }
         else
         {
-            this->running = true;
-            auto us_dura = std::chrono::microseconds(us);
-            auto alarm = std::chrono::high_resolution_clock::now() + us_dura;
+            this->run(task, asynctask);
+        }
+    }
+
+    ~Repeater()
+    {
+        // The timer thread runs on this object, so it has to finish its
+        // last tick before anything is freed, and before the worker it may
+        // still post to is stopped.
+        this->running = false;
+        if (this->async_thread != NULL)
+        {
+            this->async_thread->join();
+            delete this->async_thread;
+            this->async_thread = NULL;
+        }
+        if (this->worker_thread != NULL)
+        {
+            sem_post(&this->worker_wake);
+            this->worker_thread->join();
+            delete this->worker_thread;
+            sem_destroy(&this->worker_wake);
+        }
+    }
+
+    template <class task_t>
+    void run(task_t& task, bool asynctask)
+    {
+        auto period = std::chrono::microseconds(this->timing.us);
+        auto spin = std::chrono::microseconds(this->timing.spin_us);
+        auto deadline = clock::now() + period;
+
+        while(this->running)
+        {
+            auto woke = Repeater::sleep_until(deadline, spin);
 
-            while(this->running)
+            if (asynctask)
+            {
+                this->post_tick();
+            }
+            else
             {
-                std::chrono::microseconds sleep_dt = std::chrono::duration_cast<
-                        std::chrono::microseconds>(
-                            alarm - std::chrono::high_resolution_clock::now());
+                task();
+            }
 
-                // For sleep durations under 1ms, use a more precise spinwait
-                if (us < 100000)
-                {
-                    Repeater::spin_sleep_for(sleep_dt);
-                }
-                else
-                {
-                    std::this_thread::sleep_for(sleep_dt);
-                }
+            this->record_tick(woke - deadline, clock::now() - woke, period);
 
-                if (asynctask)
-                {
-                    std::thread* t = new std::thread(task);
-                    t->detach();
-                }
-                else
+            if (!this->timing.fixed_rate)
+            {
+                deadline = clock::now() + period;
+                continue;
+            }
+
+            deadline += period;
+            if (this->timing.missed_tick == REPEATER_SKIP)
+            {
+                auto now = clock::now();
+                if (deadline < now)
                 {
-                    task();
+                    auto missed = (now - deadline) / period + 1;
+                    deadline += missed * period;
+                    this->skipped_ticks = this->skipped_ticks + missed;
                 }
+            }
+        }
+    }
+
+    static uint8_t histogram_bucket(uint32_t us)
+    {
+        uint8_t bucket = 0;
+        while (us > 0 && bucket < REPEATER_HISTOGRAM_BUCKETS - 1)
+        {
+            us >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    void record_tick(clock::duration lateness, clock::duration duration, std::chrono::microseconds period)
+    {
+        Repeater::record_tick(this->stats, this->stats_seq, lateness, duration, period);
+    }
+
+    // A consistent copy of the timing statistics, safe to take from any thread.
+    struct RepeaterStats stats_snapshot()
+    {
+        return Repeater::stats_snapshot(this->stats, this->stats_seq);
+    }
+
+    void print_stats(FILE* out, const char* name)
+    {
+        Repeater::print_stats(out, name, this->stats_snapshot());
+    }
 
-                alarm += us_dura;
+    // The statistics helpers are shared with the Scheduler, which keeps a set
+    // of statistics per task.
+    static void record_tick(struct RepeaterStats& stats, std::atomic<uint32_t>& stats_seq,
+        clock::duration lateness, clock::duration duration, std::chrono::microseconds period)
+    {
+        uint32_t lateness_us = std::chrono::duration_cast<std::chrono::microseconds>(lateness).count();
+        uint32_t duration_us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+
+        stats_seq.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        stats.ticks++;
+        stats.lateness_us[Repeater::histogram_bucket(lateness_us)]++;
+        stats.duration_us[Repeater::histogram_bucket(duration_us)]++;
+        if (lateness_us > stats.max_lateness_us)
+        {
+            stats.max_lateness_us = lateness_us;
+        }
+        if (duration_us > stats.max_duration_us)
+        {
+            stats.max_duration_us = duration_us;
+        }
+
+        // The tick finished past the following deadline.
+        if (lateness + duration > period)
+        {
+            uint32_t overrun_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                lateness + duration - period).count();
+            stats.missed_deadlines++;
+            if (overrun_us > stats.max_overrun_us)
+            {
+                stats.max_overrun_us = overrun_us;
             }
         }
+
+        std::atomic_thread_fence(std::memory_order_release);
+        stats_seq.fetch_add(1, std::memory_order_relaxed);
     }
 
-    ~Repeater()
+    static struct RepeaterStats stats_snapshot(const struct RepeaterStats& stats, std::atomic<uint32_t>& stats_seq)
     {
-        this->running = false;
-        if (this->async_thread != NULL)
+        struct RepeaterStats snapshot;
+        uint32_t seq;
+
+        do
         {
-            delete this->async_thread;
+            seq = stats_seq.load(std::memory_order_acquire);
+            snapshot = stats;
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((seq & 1) || seq != stats_seq.load(std::memory_order_relaxed));
+
+        return snapshot;
+    }
+
+    static void print_stats(FILE* out, const char* name, const struct RepeaterStats& snapshot)
+    {
+        fprintf(out, "%s: %llu ticks, max late %uus, max duration %uus, %u missed (max overrun %uus)\n",
+            name, (unsigned long long)snapshot.ticks, snapshot.max_lateness_us,
+            snapshot.max_duration_us, snapshot.missed_deadlines, snapshot.max_overrun_us);
+        fprintf(out, "%s: %10s %10s %10s\n", name, "<us", "late", "duration");
+        for (int i = 0 ; i < REPEATER_HISTOGRAM_BUCKETS ; i++)
+        {
+            if (snapshot.lateness_us[i] == 0 && snapshot.duration_us[i] == 0)
+            {
+                continue;
+            }
+            fprintf(out, "%s: %10u %10u %10u\n", name, 1u << i,
+                snapshot.lateness_us[i], snapshot.duration_us[i]);
         }
     }
 
-    // TODO This is subject to some wild variation in actual sleep time,
-    // occasionally up and and including an extra order of magnitude.
+    void post_tick()
+    {
+        uint32_t pending = this->worker_pending.load(std::memory_order_relaxed);
+        do
+        {
+            if (pending >= this->max_pending)
+            {
+                this->dropped_ticks = this->dropped_ticks + 1;
+                return;
+            }
+        } while (!this->worker_pending.compare_exchange_weak(pending, pending + 1,
+            std::memory_order_acq_rel, std::memory_order_relaxed));
+
+        sem_post(&this->worker_wake);
+    }
+
+    // Sleep until an absolute deadline on the monotonic clock. The OS sleep
+    // is only trusted to get within spin of the deadline, since its wakeup
+    // can be late by tens of microseconds or more, and the rest is spun.
     //
-    // This needs to be more precise to be able to work with write time divs
-    // smaller than 1ms. 
+    // Sleeping to an absolute deadline (rather than for a duration computed
+    // from a clock read) means a late wakeup or a slow tick doesn't push
+    // every following tick back.
+    //
+    // Returns the time of the wakeup.
+    static clock::time_point sleep_until(clock::time_point deadline, std::chrono::microseconds spin)
+    {
+        auto now = clock::now();
+        if (deadline - now > spin)
+        {
+            std::this_thread::sleep_until(deadline - spin);
+            now = clock::now();
+        }
+
+        while (now < deadline)
+        {
+            now = clock::now();
+        }
+
+        return now;
+    }
+
     static void spin_sleep_for(std::chrono::microseconds dura)
     {
-        auto start = std::chrono::high_resolution_clock::now();
-        auto end = start;
-        auto elapsed = end - start;
-        while (elapsed < dura)
+        auto deadline = clock::now() + dura;
+        while (clock::now() < deadline)
         {
-            end = std::chrono::high_resolution_clock::now();
-            elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
         }
     }
 };
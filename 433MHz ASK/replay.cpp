@@ -0,0 +1,132 @@
+// Replay a capture recorded with ask_capture_tap() through the decoder, as
+// fast as the host allows, and print each frame found.
+//
+// Build and run on the host with:
+//   g++ -O2 -std=c++17 replay.cpp -o replay -lpthread
+//   ./replay capture.askcap [max preamble errors] [--batch]
+//
+// By default every sample goes through ask_reader_callback(), exactly as it
+// did when it was recorded, with the line code, FEC and frame formats the
+// capture header says the reader had. --batch uses the offline decoder
+// instead, which only finds v1 frames.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+
+#include "ask.hpp"
+#include "ask_batch.hpp"
+#include "ask_capture.hpp"
+
+uint32_t replay_frames = 0;
+struct ask_pool replay_pool;
+
+void replay_print(uint8_t* data, ask_len_t datalen)
+{
+    printf("DATAGRAM (%d bytes): ", datalen);
+    for (ask_len_t i = 0 ; i < datalen ; i++)
+    {
+        printf("%c", (data[i] >= 0x20 && data[i] < 0x7f) ? data[i] : '.');
+    }
+    printf("\n");
+    replay_frames++;
+}
+
+void replay_datagram(uint8_t* data, ask_len_t datalen)
+{
+    if (data == NULL)
+    {
+        fprintf(stderr, "INVALID SYMBOL READ, DISCARDING FRAME\n");
+        return;
+    }
+    replay_print(data, datalen);
+    ask_pool_return(&replay_pool, data);
+}
+
+void replay_frame(size_t offset, uint8_t* data, ask_len_t datalen)
+{
+    printf("@%zu ", offset);
+    replay_print(data, datalen);
+    free(data);
+}
+
+uint8_t replay_no_read()
+{
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s capture.askcap [max preamble errors] [--batch]\n", argv[0]);
+        return 1;
+    }
+
+    struct ask_capture capture;
+    if (!ask_capture_load(&capture, argv[1]))
+    {
+        return 1;
+    }
+
+    uint8_t preamble_max_errors = (argc > 2 && argv[2][0] != '-' ? atoi(argv[2]) : 2);
+    bool batch = (strcmp(argv[argc - 1], "--batch") == 0);
+
+    const struct ask_capture_header* header = capture.header;
+    fprintf(stderr, "%zu samples at %uus per division (%.1fs), encoding %u, FEC %u/%u%s: %.*s\n",
+        capture.num_samples, header->us_per_div,
+        capture.num_samples * header->us_per_div / 1e6,
+        header->encoding, header->fec.parity_bytes, header->fec.block_bytes,
+        (header->accept_v2 ? ", v2 frames" : ""),
+        (int)header->metadata_bytes, capture.metadata);
+
+    auto start = std::chrono::steady_clock::now();
+    if (batch)
+    {
+        if (header->accept_v2)
+        {
+            fprintf(stderr, "Warning: v2 frames are not decoded with --batch\n");
+        }
+        struct ask_batch_params params;
+        params.preamble_max_errors = preamble_max_errors;
+        params.fec = header->fec;
+        params.threads = 0;
+        params.frame_ready = &replay_frame;
+        params.encoding = (enum ENCODING)header->encoding;
+        struct ask_batch_stats stats = ask_capture_decode(&capture, params);
+        fprintf(stderr, "%u frames ok, %u FCS errors\n", stats.frames_ok, stats.fcs_errors);
+    }
+    else
+    {
+        // Payloads over ASK_MAX_PAYLOAD are dropped, as by a reader without
+        // a pool.
+        if (!ask_pool_init(&replay_pool, ASK_MAX_PAYLOAD, ASK_RX_QUEUE_DEPTH + 2))
+        {
+            fprintf(stderr, "Unable to allocate the receive pool\n");
+            ask_capture_unload(&capture);
+            return 1;
+        }
+        struct ask_reader_params params;
+        params.read = &replay_no_read;
+        params.datagram_ready = &replay_datagram;
+        params.us_per_div = header->us_per_div;
+        params.preamble_max_errors = preamble_max_errors;
+        params.fec = header->fec;
+        params.pool = &replay_pool;
+        params.encoding = (enum ENCODING)header->encoding;
+        params.accept_v2 = header->accept_v2;
+        params.max_us_per_div = 0;
+        struct ask_reader reader = ask_reader_init(params);
+        ask_capture_replay(&capture, &reader);
+        fprintf(stderr, "%u frames ok, %u FCS errors\n", reader.stats.frames_ok, reader.stats.fcs_errors);
+        ask_pool_free(&replay_pool);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    fprintf(stderr, "Replayed in %.3fs, %.0fx real time\n", seconds,
+        capture.num_samples * header->us_per_div / 1e6 / seconds);
+
+    ask_capture_unload(&capture);
+    return 0;
+}
@@ -0,0 +1,136 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <queue>
+#include <vector>
+#include <utility>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "repeater.hpp"
+
+// Runs many periodic tasks from a single thread, in deadline order.
+//
+// Where each Repeater owns a thread that spins for its own ticks, every
+// reader and writer callback registered here shares one thread, which
+// sleeps until the earliest deadline in a min-heap, runs that task, and
+// puts it back with its next deadline. N channels then cost about one core
+// rather than N.
+//
+// Tasks are fixed-rate and catch up on missed deadlines, like a default
+// Repeater. They must all be added before the scheduler is started.
+class Scheduler
+{
+public:
+    typedef Repeater::clock clock;
+
+    struct task
+    {
+        std::function<void()> f;
+        std::chrono::microseconds period;
+        clock::time_point deadline;
+        struct RepeaterStats stats;
+    };
+
+    volatile bool running = false;
+    std::thread* async_thread = NULL;
+    // The final stretch before each deadline that is spun rather than slept.
+    uint32_t spin_us = 100;
+
+    std::vector<struct task> tasks;
+    std::atomic<uint32_t> stats_seq{0};
+
+    ~Scheduler()
+    {
+        this->stop();
+    }
+
+    // Register a task to be run every us microseconds, returning its id.
+    template <class callable, class... arguments>
+    size_t add(uint32_t us, callable&& f, arguments&&... args)
+    {
+        struct task t;
+        t.f = std::bind(std::forward<callable>(f), std::forward<arguments>(args)...);
+        t.period = std::chrono::microseconds(us);
+        t.stats = {};
+        this->tasks.push_back(t);
+        return this->tasks.size() - 1;
+    }
+
+    // Start dispatching, either on a new thread, or on the calling thread
+    // until stop() is called from elsewhere.
+    void start(bool async)
+    {
+        this->running = true;
+        if (async)
+        {
+            this->async_thread = new std::thread([this]() {
+                this->run();
+            });
+        }
+        else
+        {
+            this->run();
+        }
+    }
+
+    void stop()
+    {
+        this->running = false;
+        if (this->async_thread != NULL)
+        {
+            this->async_thread->join();
+            delete this->async_thread;
+            this->async_thread = NULL;
+        }
+    }
+
+    void run()
+    {
+        // Ordered by deadline, and then by task id so that tasks due at the
+        // same instant always run in the order they were added.
+        typedef std::pair<clock::time_point, size_t> entry;
+        std::priority_queue<entry, std::vector<entry>, std::greater<entry> > heap;
+
+        auto spin = std::chrono::microseconds(this->spin_us);
+        auto start = clock::now();
+        for (size_t i = 0 ; i < this->tasks.size() ; i++)
+        {
+            this->tasks[i].deadline = start + this->tasks[i].period;
+            heap.push(entry(this->tasks[i].deadline, i));
+        }
+
+        while (this->running && !heap.empty())
+        {
+            entry next = heap.top();
+            heap.pop();
+            struct task& t = this->tasks[next.second];
+
+            auto woke = Repeater::sleep_until(t.deadline, spin);
+            t.f();
+            Repeater::record_tick(t.stats, this->stats_seq,
+                woke - t.deadline, clock::now() - woke, t.period);
+
+            t.deadline += t.period;
+            heap.push(entry(t.deadline, next.second));
+        }
+    }
+
+    // A consistent copy of a task's timing statistics, safe to take from any thread.
+    struct RepeaterStats stats_snapshot(size_t id)
+    {
+        return Repeater::stats_snapshot(this->tasks[id].stats, this->stats_seq);
+    }
+
+    void print_stats(FILE* out, size_t id, const char* name)
+    {
+        Repeater::print_stats(out, name, this->stats_snapshot(id));
+    }
+};
+
+#endif
@@ -0,0 +1,231 @@
+// Sweep the link settings (division time and line code) over a set of
+// simulated channels, and print the packet error rate, goodput and latency
+// of each, to choose settings from.
+//
+// DIV_PER_BIT is fixed at build time, so build once for each value to
+// compare, e.g.:
+//   g++ -O2 -std=c++17 -DDIV_PER_BIT=4 sim.cpp -o sim4 -lpthread
+//   ./sim4 [frames per point] [seed] [v1|v2] > sim4.csv
+//
+// With --arq, it instead sweeps the ARQ window over the same channels (the
+// same one each way), sending 32-byte segments at 50us per division:
+//   ./sim4 --arq [segments per point] [seed] > arq.csv
+//
+// With --detect, it compares a reader polling at each writer's rate with
+// one sampling every 10us and detecting the rate from each preamble:
+//   ./sim4 --detect [frames per point] [seed] [v1|v2] > detect.csv
+//
+// The results are CSV on stdout. The same seed always gives the same results.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "ask.hpp"
+#include "ask_sim.hpp"
+
+struct sim_preset {
+    const char* name;
+    struct ask_sim_channel channel;
+};
+
+// Mean gaps and lengths in us of impulses, bursts (with the chance of a flip
+// during one) and dropouts, tx/rx ppm, drift, jitter
+static const struct sim_preset SIM_PRESETS[] = {
+    {"clean",   {0,      0,  0,     0,    0,   0,     0,     0,    0,   0,   0}},
+    {"noisy",   {20000,  80, 0,     0,    0,   0,     0,     0,    0,   0,   0}},
+    {"bursty",  {200000, 80, 5e5,   2500, 0.4, 0,     0,     0,    0,   0,   0}},
+    {"dropout", {0,      0,  0,     0,    0,   2e6,   10000, 0,    0,   0,   0}},
+    {"skewed",  {0,      0,  0,     0,    0,   0,     0,     500, -500, 1,   0}},
+    {"jittery", {0,      0,  0,     0,    0,   0,     0,     0,    0,   0,   20000}},
+    {"field",   {50000,  80, 1e6,   2500, 0.3, 5e6,   10000, 100, -100, 0.1, 5000}},
+};
+
+static const uint32_t SIM_US_PER_DIV[] = {25, 50, 100, 200};
+
+static const char* SIM_ENCODINGS[] = {"balanced", "unbalanced", "manchester"};
+
+static const uint8_t SIM_ARQ_WINDOWS[] = {1, 4, 8, 16, 32};
+
+static const uint32_t SIM_DETECT_SAMPLE_US = 10;
+
+// Run the points from 0 to num_points - 1 on every core.
+template<typename F> void sim_parallel(size_t num_points, F run_point)
+{
+    std::atomic<size_t> next_point{0};
+
+    uint32_t threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+    {
+        threads = 1;
+    }
+
+    std::vector<std::thread> pool;
+    for (uint32_t t = 0 ; t < threads ; t++)
+    {
+        pool.push_back(std::thread([&]() {
+            for (size_t i = next_point++ ; i < num_points ; i = next_point++)
+            {
+                run_point(i);
+            }
+        }));
+    }
+    for (std::thread& thread : pool)
+    {
+        thread.join();
+    }
+}
+
+int sim_arq(int argc, char** argv)
+{
+    uint32_t segments = (argc > 2 ? atoi(argv[2]) : 500);
+    uint64_t seed = (argc > 3 ? strtoull(argv[3], NULL, 0) : 1);
+
+    const size_t num_presets = sizeof(SIM_PRESETS) / sizeof(SIM_PRESETS[0]);
+    const size_t num_windows = sizeof(SIM_ARQ_WINDOWS) / sizeof(SIM_ARQ_WINDOWS[0]);
+    std::vector<struct ask_sim_arq_results> results(num_presets * num_windows);
+
+    auto start = std::chrono::steady_clock::now();
+    sim_parallel(results.size(), [&](size_t i) {
+        const uint32_t us_per_div = 50;
+        struct ask_sim_channel channel = SIM_PRESETS[i / num_windows].channel;
+        if (channel.jitter_ns >= us_per_div * 500)
+        {
+            channel.jitter_ns = us_per_div * 500 - 1;
+        }
+
+        struct ask_sim_arq_params params = {us_per_div, segments, 32, SIM_ARQ_WINDOWS[i % num_windows], 2, {0, 0}, seed, channel, channel};
+        results[i] = ask_sim_arq_run(params);
+    });
+    auto end = std::chrono::steady_clock::now();
+
+    uint64_t total_segments = 0;
+    printf("div_per_bit,window,channel,delivered,corrupt,goodput_bps,capacity_bps,efficiency,latency_mean_us,retransmits,fast_retransmits,timeouts,duplicates\n");
+    for (size_t i = 0 ; i < results.size() ; i++)
+    {
+        total_segments += results[i].sender.segments_sent;
+        printf("%d,%u,%s,%u,%u,%.1f,%.1f,%.3f,%.0f,%u,%u,%u,%u\n", DIV_PER_BIT,
+            SIM_ARQ_WINDOWS[i % num_windows], SIM_PRESETS[i / num_windows].name,
+            results[i].segments_delivered, results[i].segments_corrupt,
+            results[i].goodput_bps, results[i].capacity_bps,
+            results[i].goodput_bps / results[i].capacity_bps,
+            results[i].latency_mean_us, results[i].sender.retransmits,
+            results[i].sender.fast_retransmits, results[i].sender.timeouts,
+            results[i].receiver.duplicates);
+    }
+
+    fprintf(stderr, "%llu segments in %.1fs\n", (unsigned long long)total_segments,
+        std::chrono::duration<double>(end - start).count());
+    return 0;
+}
+
+int sim_detect(int argc, char** argv)
+{
+    uint32_t frames = (argc > 2 ? atoi(argv[2]) : 2000);
+    uint64_t seed = (argc > 3 ? strtoull(argv[3], NULL, 0) : 1);
+    enum ASK_FRAME_FORMAT format = (argc > 4 && strcmp(argv[4], "v2") == 0 ? ASK_FRAME_V2 : ASK_FRAME_V1);
+
+    // Each point is run with the reader at the writer's rate, then detecting it.
+    const size_t num_presets = sizeof(SIM_PRESETS) / sizeof(SIM_PRESETS[0]);
+    const size_t num_rates = sizeof(SIM_US_PER_DIV) / sizeof(SIM_US_PER_DIV[0]);
+    std::vector<struct ask_sim_results> results(num_presets * num_rates * 2);
+
+    auto start = std::chrono::steady_clock::now();
+    sim_parallel(results.size(), [&](size_t i) {
+        uint32_t us_per_div = SIM_US_PER_DIV[i / 2 % num_rates];
+        uint32_t sample_us = (i % 2 ? SIM_DETECT_SAMPLE_US : 0);
+
+        // Jitter can't reach half a sample.
+        struct ask_sim_channel channel = SIM_PRESETS[i / 2 / num_rates].channel;
+        uint32_t max_jitter_ns = (sample_us != 0 ? sample_us : us_per_div) * 500 - 1;
+        if (channel.jitter_ns > max_jitter_ns)
+        {
+            channel.jitter_ns = max_jitter_ns;
+        }
+
+        struct ask_sim_params params = {us_per_div, frames, 32, 2, {0, 0}, true, DIV_PER_BIT, seed, channel,
+            BALANCED_REPEATED, format, sample_us};
+        results[i] = ask_sim_run(params);
+    });
+    auto end = std::chrono::steady_clock::now();
+
+    uint64_t total_frames = 0;
+    printf("div_per_bit,us_per_div,channel,reader,frames,ok,corrupt,per,goodput_bps,rate_detections\n");
+    for (size_t i = 0 ; i < results.size() ; i++)
+    {
+        total_frames += results[i].frames_sent;
+        printf("%d,%u,%s,%s,%u,%u,%u,%.4f,%.1f,%u\n", DIV_PER_BIT,
+            SIM_US_PER_DIV[i / 2 % num_rates], SIM_PRESETS[i / 2 / num_rates].name,
+            (i % 2 ? "detect" : "fixed"), results[i].frames_sent, results[i].frames_ok,
+            results[i].frames_corrupt, results[i].packet_error_rate, results[i].goodput_bps,
+            results[i].reader_stats.rate_detections);
+    }
+
+    fprintf(stderr, "%llu frames in %.1fs\n", (unsigned long long)total_frames,
+        std::chrono::duration<double>(end - start).count());
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--arq") == 0)
+    {
+        return sim_arq(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--detect") == 0)
+    {
+        return sim_detect(argc, argv);
+    }
+
+    uint32_t frames = (argc > 1 ? atoi(argv[1]) : 2000);
+    uint64_t seed = (argc > 2 ? strtoull(argv[2], NULL, 0) : 1);
+    enum ASK_FRAME_FORMAT format = (argc > 3 && strcmp(argv[3], "v2") == 0 ? ASK_FRAME_V2 : ASK_FRAME_V1);
+
+    // Every point is independent, so they are shared out between threads,
+    // and printed in order at the end.
+    const size_t num_presets = sizeof(SIM_PRESETS) / sizeof(SIM_PRESETS[0]);
+    const size_t num_rates = sizeof(SIM_US_PER_DIV) / sizeof(SIM_US_PER_DIV[0]);
+    const size_t num_encodings = sizeof(SIM_ENCODINGS) / sizeof(SIM_ENCODINGS[0]);
+    std::vector<struct ask_sim_results> results(num_presets * num_encodings * num_rates);
+
+    auto start = std::chrono::steady_clock::now();
+    sim_parallel(results.size(), [&](size_t i) {
+        uint32_t us_per_div = SIM_US_PER_DIV[i % num_rates];
+        enum ENCODING encoding = (enum ENCODING)(i / num_rates % num_encodings);
+
+        // Jitter can't reach half a division.
+        struct ask_sim_channel channel = SIM_PRESETS[i / num_rates / num_encodings].channel;
+        if (channel.jitter_ns >= us_per_div * 500)
+        {
+            channel.jitter_ns = us_per_div * 500 - 1;
+        }
+
+        struct ask_sim_params params = {us_per_div, frames, 32, 2, {0, 0}, true, DIV_PER_BIT, seed, channel, encoding, format, 0};
+        results[i] = ask_sim_run(params);
+    });
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    uint64_t total_frames = 0;
+    printf("div_per_bit,encoding,us_per_div,channel,frames,ok,corrupt,per,goodput_bps,latency_mean_us,latency_max_us,fcs_errors\n");
+    for (size_t i = 0 ; i < results.size() ; i++)
+    {
+        total_frames += results[i].frames_sent;
+        printf("%d,%s,%u,%s,%u,%u,%u,%.4f,%.1f,%.0f,%.0f,%u\n", DIV_PER_BIT,
+            SIM_ENCODINGS[i / num_rates % num_encodings], SIM_US_PER_DIV[i % num_rates],
+            SIM_PRESETS[i / num_rates / num_encodings].name,
+            results[i].frames_sent, results[i].frames_ok, results[i].frames_corrupt,
+            results[i].packet_error_rate, results[i].goodput_bps,
+            results[i].latency_mean_us, results[i].latency_max_us,
+            results[i].reader_stats.fcs_errors);
+    }
+
+    fprintf(stderr, "%llu frames in %.1fs (%.0f frames/minute)\n",
+        (unsigned long long)total_frames, seconds, total_frames / seconds * 60);
+    return 0;
+}